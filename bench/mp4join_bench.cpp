@@ -0,0 +1,358 @@
+#include <mp4join/mp4join.hpp>
+#include "join_resources.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace {
+
+using namespace mp4join;
+namespace fs = std::filesystem;
+
+// What the synthetic inputs look like. Every input has the same tracks and sample counts, only the sample sizes differ.
+struct GenOptions {
+    unsigned files = 4;
+    unsigned tracks = 2;            // Media tracks, alternately video-like (varying sizes, sync samples, sdtp) and audio-like (constant size).
+    std::uint32_t samples = 50000;  // Per track and file.
+    std::uint64_t file_size = std::uint64_t(64) << 20; // Approximate mdat size of each input.
+    bool co64 = false;
+    bool tmcd = false;              // Add a timecode track with a single sample, as cameras do.
+    bool moov_first = false;
+};
+
+constexpr std::uint32_t samples_per_chunk = 8;
+constexpr std::uint32_t sync_interval = 30;
+constexpr std::uint32_t movie_timescale = 1000;
+
+// Big-endian box writer.
+class BoxWriter {
+public:
+    std::vector<unsigned char> buf;
+
+    void u8(std::uint8_t v) { buf.push_back(v); }
+    void u16(std::uint16_t v) { u8(std::uint8_t(v >> 8)); u8(std::uint8_t(v)); }
+    void u32(std::uint32_t v) { u16(std::uint16_t(v >> 16)); u16(std::uint16_t(v)); }
+    void u64(std::uint64_t v) { u32(std::uint32_t(v >> 32)); u32(std::uint32_t(v)); }
+    void zeros(std::size_t n) { buf.insert(buf.end(), n, 0); }
+    void fourcc(const char* t) { buf.insert(buf.end(), t, t + 4); }
+
+    // Start a box, to be finished by end().
+    void begin(const char* type) { open.push_back(buf.size()); u32(0); fourcc(type); }
+    void begin(const char* type, std::uint8_t version, std::uint32_t flags) { begin(type); u32(std::uint32_t(version) << 24 | flags); }
+    void end() {
+        const auto start = open.back();
+        open.pop_back();
+        const auto size = std::uint32_t(buf.size() - start);
+        for (int i = 0; i < 4; ++i) buf[start + i] = std::uint8_t(size >> (24 - 8 * i));
+    }
+
+private:
+    std::vector<std::size_t> open;
+};
+
+// One track of a synthetic input.
+struct Track {
+    enum Kind { Video, Audio, Timecode } kind;
+    std::uint32_t timescale, delta;
+    std::vector<std::uint32_t> sizes; // One per sample
+    std::vector<std::uint64_t> chunks; // Chunk offsets, relative to the mdat data
+};
+
+void
+write_trak(BoxWriter& w, const Track& t, std::uint32_t track_id, std::uint64_t mdat_data_offset, bool co64)
+{
+    const auto count = std::uint32_t(t.sizes.size());
+    const auto duration = std::uint64_t(count) * t.delta;
+    const auto movie_duration = std::uint32_t(duration * movie_timescale / t.timescale);
+    const char* const handler = t.kind == Track::Video ? "vide" : t.kind == Track::Audio ? "soun" : "tmcd";
+    const char* const format = t.kind == Track::Video ? "avc1" : t.kind == Track::Audio ? "mp4a" : "tmcd";
+
+    w.begin("trak");
+    w.begin("tkhd", 0, 3);
+    w.zeros(8); w.u32(track_id); w.zeros(4); w.u32(movie_duration); w.zeros(8);
+    w.u16(0); w.u16(0); w.u16(t.kind == Track::Audio ? 0x0100 : 0); w.zeros(2);
+    for (std::uint32_t m : {0x10000u, 0u, 0u, 0u, 0x10000u, 0u, 0u, 0u, 0x40000000u}) w.u32(m);
+    w.u32(t.kind == Track::Video ? 1920u << 16 : 0); w.u32(t.kind == Track::Video ? 1080u << 16 : 0);
+    w.end();
+    w.begin("edts");
+    w.begin("elst", 0, 0);
+    w.u32(1); w.u32(movie_duration); w.u32(0); w.u32(0x10000);
+    w.end();
+    w.end();
+
+    w.begin("mdia");
+    w.begin("mdhd", 0, 0);
+    w.zeros(8); w.u32(t.timescale); w.u32(std::uint32_t(duration)); w.u16(0x55c4); w.u16(0); // "und"
+    w.end();
+    w.begin("hdlr", 0, 0);
+    w.zeros(4); w.fourcc(handler); w.zeros(12); w.u8(0);
+    w.end();
+
+    w.begin("minf");
+    if (t.kind == Track::Video) { w.begin("vmhd", 0, 1); w.zeros(8); w.end(); }
+    else if (t.kind == Track::Audio) { w.begin("smhd", 0, 0); w.zeros(4); w.end(); }
+    else { w.begin("gmhd"); w.begin("tmcd"); w.end(); w.end(); }
+    w.begin("dinf");
+    w.begin("dref", 0, 0);
+    w.u32(1);
+    w.begin("url ", 0, 1); w.end();
+    w.end();
+    w.end();
+
+    w.begin("stbl");
+    w.begin("stsd", 0, 0);
+    w.u32(1);
+    w.begin(format); w.zeros(6); w.u16(1); w.end();
+    w.end();
+    w.begin("stts", 0, 0);
+    w.u32(1); w.u32(count); w.u32(t.delta);
+    w.end();
+    if (t.kind == Track::Video) {
+        w.begin("stss", 0, 0);
+        w.u32((count + sync_interval - 1) / sync_interval);
+        for (std::uint32_t i = 0; i < count; i += sync_interval) w.u32(i + 1);
+        w.end();
+    }
+    const auto nb_chunks = std::uint32_t(t.chunks.size());
+    const auto spc = t.kind == Track::Timecode ? 1 : samples_per_chunk;
+    const auto last_spc = count - spc * (nb_chunks - 1);
+    w.begin("stsc", 0, 0);
+    w.u32(last_spc == spc ? 1 : 2);
+    w.u32(1); w.u32(spc); w.u32(1);
+    if (last_spc != spc) { w.u32(nb_chunks); w.u32(last_spc); w.u32(1); }
+    w.end();
+    w.begin("stsz", 0, 0);
+    if (t.kind == Track::Video) {
+        w.u32(0); w.u32(count);
+        for (auto s : t.sizes) w.u32(s);
+    }
+    else {
+        w.u32(t.sizes.front()); w.u32(count);
+    }
+    w.end();
+    w.begin(co64 ? "co64" : "stco", 0, 0);
+    w.u32(nb_chunks);
+    for (auto c : t.chunks) {
+        if (co64) w.u64(mdat_data_offset + c);
+        else w.u32(std::uint32_t(mdat_data_offset + c));
+    }
+    w.end();
+    if (t.kind == Track::Video) {
+        w.begin("sdtp", 0, 0);
+        for (std::uint32_t i = 0; i < count; ++i) w.u8(i % sync_interval ? 0x10 : 0x20);
+        w.end();
+    }
+    w.end(); // stbl
+    w.end(); // minf
+    w.end(); // mdia
+    w.end(); // trak
+}
+
+BoxWriter
+ftyp_box()
+{
+    BoxWriter w;
+    w.begin("ftyp");
+    w.fourcc("isom"); w.u32(0x200); w.fourcc("isom"); w.fourcc("iso2"); w.fourcc("mp41");
+    w.end();
+    return w;
+}
+
+// Write input number `index`. Sample sizes come from a generator seeded with the index, so the same options always
+// give the same files. Returns the sizes of its moov and of its media data, or {0, 0} on error.
+std::pair<std::uint64_t, std::uint64_t>
+generate(const GenOptions& opt, unsigned index, const fs::path& path)
+{
+    std::mt19937 rng(index + 1);
+    const auto avg = std::max<std::uint64_t>(opt.file_size / (std::uint64_t(opt.tracks) * opt.samples), 2);
+
+    std::vector<Track> tracks;
+    for (unsigned i = 0; i < opt.tracks; ++i) {
+        Track t;
+        t.kind = i % 2 ? Track::Audio : Track::Video;
+        t.timescale = t.kind == Track::Video ? 30000 : 48000;
+        t.delta = t.kind == Track::Video ? 1001 : 1024;
+        for (std::uint32_t n = 0; n < opt.samples; ++n) {
+            t.sizes.push_back(t.kind == Track::Video ? std::uint32_t(avg / 2 + rng() % avg) : std::uint32_t(avg));
+        }
+        tracks.push_back(std::move(t));
+    }
+
+    // Chunks of samples_per_chunk samples, interleaved track by track, after the timecode sample.
+    std::uint64_t mdat_size = 0;
+    if (opt.tmcd) {
+        Track t{Track::Timecode, 30000, std::uint32_t(std::uint64_t(opt.samples) * 1001), {4}, {0}};
+        mdat_size = 4;
+        tracks.push_back(std::move(t));
+    }
+    for (std::uint32_t first = 0; first < opt.samples; first += samples_per_chunk) {
+        for (unsigned i = 0; i < opt.tracks; ++i) {
+            tracks[i].chunks.push_back(mdat_size);
+            for (auto n = first; n < std::min(first + samples_per_chunk, opt.samples); ++n) mdat_size += tracks[i].sizes[n];
+        }
+    }
+
+    const auto ftyp = ftyp_box();
+    const std::uint64_t mdat_header = mdat_size + 8 > UINT32_MAX ? 16 : 8;
+
+    // The chunk offsets depend on the size of moov when it comes first, but that size doesn't depend on them.
+    const auto write_moov = [&](std::uint64_t mdat_data_offset) {
+        BoxWriter w;
+        w.begin("moov");
+        w.begin("mvhd", 0, 0);
+        w.zeros(8); w.u32(movie_timescale); w.u32(std::uint32_t(std::uint64_t(opt.samples) * 1001 * movie_timescale / 30000));
+        w.u32(0x10000); w.u16(0x0100); w.zeros(10);
+        for (std::uint32_t m : {0x10000u, 0u, 0u, 0u, 0x10000u, 0u, 0u, 0u, 0x40000000u}) w.u32(m);
+        w.zeros(24); w.u32(std::uint32_t(tracks.size() + 1));
+        w.end();
+        for (std::size_t i = 0; i < tracks.size(); ++i) write_trak(w, tracks[i], std::uint32_t(i + 1), mdat_data_offset, opt.co64);
+        w.end();
+        return std::move(w.buf);
+    };
+    auto moov = write_moov(0);
+    const auto mdat_data_offset = ftyp.buf.size() + (opt.moov_first ? moov.size() : 0) + mdat_header;
+    if (!opt.co64 && mdat_data_offset + mdat_size > UINT32_MAX) return {0, 0};
+    moov = write_moov(mdat_data_offset);
+
+    FILE* const f = std::fopen(path.string().c_str(), "wb");
+    if (!f) return {0, 0};
+    bool ok = std::fwrite(ftyp.buf.data(), 1, ftyp.buf.size(), f) == ftyp.buf.size();
+    if (ok && opt.moov_first) ok = std::fwrite(moov.data(), 1, moov.size(), f) == moov.size();
+    if (ok) {
+        BoxWriter h;
+        if (mdat_header == 16) { h.u32(1); h.fourcc("mdat"); h.u64(mdat_size + 16); }
+        else { h.u32(std::uint32_t(mdat_size + 8)); h.fourcc("mdat"); }
+        ok = std::fwrite(h.buf.data(), 1, h.buf.size(), f) == h.buf.size();
+    }
+    // The sample data itself doesn't matter, but it shouldn't be all zeros, or file systems might not store it.
+    std::vector<unsigned char> block(1 << 20);
+    for (auto& b : block) b = std::uint8_t(rng());
+    for (auto left = mdat_size; ok && left; ) {
+        const auto n = std::size_t(std::min<std::uint64_t>(left, block.size()));
+        ok = std::fwrite(block.data(), 1, n, f) == n;
+        left -= n;
+    }
+    if (ok && !opt.moov_first) ok = std::fwrite(moov.data(), 1, moov.size(), f) == moov.size();
+    if (std::fclose(f) != 0) ok = false;
+    if (!ok) return {0, 0};
+    return {moov.size(), mdat_size};
+}
+
+// One line of JSON per phase: the input options, how much it processed, and the fastest and median of the runs.
+void
+report(const char* phase, const GenOptions& opt, unsigned runs, std::vector<double> times, std::uint64_t samples, std::uint64_t bytes)
+{
+    std::sort(times.begin(), times.end());
+    const double best = times.front(), median = times[times.size() / 2];
+    std::printf("{\"phase\":\"%s\",\"files\":%u,\"tracks\":%u,\"samples_per_track\":%u,\"file_size\":%llu,\"co64\":%s,\"tmcd\":%s,"
+                "\"moov_first\":%s,\"runs\":%u,\"samples\":%llu,\"bytes\":%llu,\"min_s\":%.9f,\"median_s\":%.9f,"
+                "\"samples_per_s\":%.0f,\"bytes_per_s\":%.0f}\n",
+                phase, opt.files, opt.tracks, opt.samples, (unsigned long long)opt.file_size, opt.co64 ? "true" : "false",
+                opt.tmcd ? "true" : "false", opt.moov_first ? "true" : "false", runs, (unsigned long long)samples,
+                (unsigned long long)bytes, best, median, best > 0 ? samples / best : 0.0, best > 0 ? bytes / best : 0.0);
+}
+
+}
+
+
+int main(int argc, char** argv)
+{
+    GenOptions opt;
+    unsigned runs = 5;
+    fs::path dir;
+    bool keep = false;
+
+    {
+        bool err_flag = false;
+        for (int i = 1; i < argc && !err_flag; ++i) {
+            // Numeric options: -n files, -t tracks, -s samples per track, -z MiB per file, -i runs.
+            const auto number = [&](auto& value, unsigned long long min, unsigned long long max, unsigned long long scale = 1) {
+                char* end = nullptr;
+                const auto v = ++i < argc ? std::strtoull(argv[i], &end, 10) : 0;
+                err_flag = !end || *end || v < min || v > max;
+                value = std::remove_reference_t<decltype(value)>(v * scale);
+            };
+            if (!std::strcmp(argv[i], "-n")) number(opt.files, 2, 10000);
+            else if (!std::strcmp(argv[i], "-t")) number(opt.tracks, 1, 100);
+            else if (!std::strcmp(argv[i], "-s")) number(opt.samples, 1, 100000000);
+            else if (!std::strcmp(argv[i], "-z")) number(opt.file_size, 1, 1 << 20, 1 << 20);
+            else if (!std::strcmp(argv[i], "-i")) number(runs, 1, 1000);
+            else if (!std::strcmp(argv[i], "-d")) {
+                if (++i < argc) dir = argv[i];
+                else err_flag = true;
+            }
+            else if (!std::strcmp(argv[i], "-6")) opt.co64 = true;
+            else if (!std::strcmp(argv[i], "-T")) opt.tmcd = true;
+            else if (!std::strcmp(argv[i], "-f")) opt.moov_first = true;
+            else if (!std::strcmp(argv[i], "-k")) keep = true;
+            else err_flag = true;
+        }
+        if (err_flag) {
+            std::puts("Usage: mp4join_bench [-n files] [-t tracks] [-s samples_per_track] [-z MiB_per_file] [-6] [-T] [-f] [-i runs] [-d dir] [-k]\n"
+                      "  -6  co64 chunk offsets instead of stco\n"
+                      "  -T  add a timecode track\n"
+                      "  -f  inputs with moov in front of mdat\n"
+                      "  -d  where to generate the inputs and write the output, the temporary directory by default\n"
+                      "  -k  keep the generated inputs");
+            return 1;
+        }
+    }
+
+    std::error_code ec;
+    if (dir.empty()) dir = fs::temp_directory_path(ec) / "mp4join_bench";
+    fs::create_directories(dir, ec);
+
+    std::vector<std::string> names;
+    std::uint64_t moov_bytes = 0, mdat_bytes = 0;
+    for (unsigned i = 0; i < opt.files; ++i) {
+        names.push_back((dir / ("input_" + std::to_string(i) + ".mp4")).string());
+        const auto [moov, mdat] = generate(opt, i, names.back());
+        if (!moov) {
+            std::fprintf(stderr, "Could not generate %s%s\n", names.back().c_str(), opt.co64 ? "" : " (large inputs need -6)");
+            return 1;
+        }
+        moov_bytes += moov;
+        mdat_bytes += mdat;
+    }
+    std::vector<const char*> inputs;
+    for (const auto& n : names) inputs.push_back(n.c_str());
+    const auto output = (dir / "output.mp4").string();
+    const auto samples = std::uint64_t(opt.files) * opt.samples * opt.tracks;
+
+    // Single-threaded scans, so that the parse rate doesn't depend on the number of cores.
+    std::vector<double> scan, moov, mdat;
+    std::uint64_t moov_out = 0;
+    for (unsigned r = 0; r < runs; ++r) {
+        JoinStats stats;
+        JoinOptions options;
+        options.stats = &stats;
+        JoinResources res;
+        res.max_threads = 1;
+        const auto ret = join_files(int(inputs.size()), inputs.data(), output.c_str(), options, {}, res);
+        if (ret != JoinResult::Success) {
+            std::fprintf(stderr, "Join failed: %d\n", static_cast<int>(ret));
+            return 1;
+        }
+        scan.push_back(stats.validate.wall_seconds + stats.merge.wall_seconds);
+        moov.push_back(stats.moov.wall_seconds);
+        mdat.push_back(stats.mdat.wall_seconds);
+        moov_out = fs::file_size(output, ec) - ftyp_box().buf.size() - 16 - mdat_bytes; // the output mdat has a 64-bit header
+        fs::remove(output, ec);
+    }
+
+    report("scan", opt, runs, scan, samples, moov_bytes);
+    report("moov_write", opt, runs, moov, samples, moov_out);
+    report("mdat_copy", opt, runs, mdat, samples, mdat_bytes);
+
+    if (!keep) {
+        for (const auto& n : names) fs::remove(n, ec);
+    }
+    return 0;
+}
@@ -1,37 +1,82 @@
 #include "lfs.h"
 #include "binary_file_stream.hpp"
+#include "io_stats.hpp"
+#include <algorithm>
+
+#if !defined(_WIN32) && __has_include(<sys/mman.h>)
+#  include <sys/mman.h>
+#  define MP4JOIN_HAVE_MMAP
+#endif
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#  include <cerrno>
+#  include <fcntl.h>
+#  include <sys/ioctl.h>
+#  include <sys/sendfile.h>
+#  include <sys/stat.h>
+#  include <sys/sysmacros.h>
+#  include <linux/fs.h>
+#endif
 
 struct BinaryFileStream::Impl {
     FILE* fp = nullptr;
     OffsetType fsize = -1;
+    bool kernel_copy = true; // cleared once the kernel refuses to copy from this file
+    const unsigned char* map = nullptr; // whole-file mapping in READ_MMAP mode
+    OffsetType pos = 0;                 // read position, used instead of fp's while mapped
+    IoStats* stats = nullptr;
 
     ~Impl() noexcept {
+        unmap();
         if(fp) fclose(fp);
     }
 
     bool open(const std::string& filename, OpenMode mode) noexcept {
         if(fp) return false;
 
-        fp = fopen(filename.c_str(), mode == OpenMode::READ? "rb" : "wb");
+        fp = fopen(filename.c_str(), mode == OpenMode::WRITE? "wb" : mode == OpenMode::UPDATE? "r+b" : "rb");
         if(!fp) return false;
 
-        if (mode == OpenMode::READ && fseek64(fp, 0, SEEK_END) == 0) {
+        if (mode != OpenMode::WRITE && fseek64(fp, 0, SEEK_END) == 0) {
             fsize = ftell64(fp);
             fseek64(fp, 0, SEEK_SET);
         }
 
-        if (mode == OpenMode::READ && fsize < 0) {
+        if (mode != OpenMode::WRITE && fsize < 0) {
             fclose(fp);
             fp = nullptr;
             return false;
         }
 
+        if (mode == OpenMode::READ_MMAP) mapFile(); // keep using stdio if this fails
+
         return true;
     }
 
+    void mapFile() noexcept {
+#ifdef MP4JOIN_HAVE_MMAP
+        if(fsize <= 0 || std::uint64_t(fsize) > SIZE_MAX) return;
+
+        void* p = mmap(nullptr, std::size_t(fsize), PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if(p == MAP_FAILED) return;
+        map = static_cast<const unsigned char*>(p);
+        pos = 0;
+#endif
+    }
+
+    void unmap() noexcept {
+#ifdef MP4JOIN_HAVE_MMAP
+        if(map) munmap(const_cast<unsigned char*>(map), std::size_t(fsize));
+#endif
+        map = nullptr;
+    }
+
     bool close() noexcept {
         if(!fp) return false;
 
+        unmap();
         fclose(fp);
         fp = nullptr;
         fsize = -1;
@@ -42,20 +87,40 @@ struct BinaryFileStream::Impl {
         if(!fp) return false;
         if(n == 0) return true;
 
-        if(fread(buf, n, 1, fp) == 1) return true;
-        return false;
+        if(map) {
+            if(pos < 0 || pos > fsize || n > std::uint64_t(fsize - pos)) return false;
+            std::memcpy(buf, map + pos, n);
+            pos += n;
+            if(stats) stats->mappedRead(n);
+            return true;
+        }
+
+        const auto start = stats ? IoStats::Clock::now() : IoStats::Clock::time_point{};
+        if(fread(buf, n, 1, fp) != 1) return false;
+        if(stats) stats->read(n, start);
+        return true;
     }
 
     bool write(const void* buf, std::size_t n) noexcept {
-        if(!fp) return false;
+        if(!fp || map) return false;
 
-        if(fwrite(buf, n, 1, fp) == 1) return true;
-        return false;
+        const auto start = stats ? IoStats::Clock::now() : IoStats::Clock::time_point{};
+        if(fwrite(buf, n, 1, fp) != 1) return false;
+        if(stats) stats->write(n, start);
+        return true;
     }
 
     bool seek(OffsetType offset, SeekFrom from) noexcept {
         if(!fp) return false;
 
+        if(map) {
+            const auto base = from == SeekFrom::Current ? pos : from == SeekFrom::End ? fsize : 0;
+            if(base + offset < 0) return false;
+            pos = base + offset;
+            return true;
+        }
+
+        if(stats) stats->seek();
         return fseek64(fp, offset, [from] {
             switch(from) {
                 case(BinaryFileStream::SeekFrom::Begin)  : return SEEK_SET;
@@ -68,11 +133,42 @@ struct BinaryFileStream::Impl {
 
     OffsetType tell() noexcept {
         if(!fp) return -1;
+        if(map) return pos;
 
         return ftell64(fp);
     }
 };
 
+namespace {
+
+#ifdef __linux__
+// copy_file_range() and sendfile() move at most ~2 GiB per call anyway.
+constexpr std::size_t KERNEL_COPY_CHUNK = std::size_t(1) << 30;
+
+// Share the extents instead of copying them. Only possible on btrfs/XFS-like file systems,
+// and only if both offsets and the length are aligned to the file system block size.
+bool clone_range(int in_fd, off_t in_off, int out_fd, off_t out_off, std::size_t n) noexcept
+{
+#ifdef FICLONERANGE
+    struct stat st;
+    if (fstat(out_fd, &st) != 0 || st.st_blksize <= 0) return false;
+    const off_t blk = st.st_blksize;
+    if (in_off % blk != 0 || out_off % blk != 0 || off_t(n) % blk != 0) return false;
+
+    file_clone_range arg{};
+    arg.src_fd = in_fd;
+    arg.src_offset = in_off;
+    arg.src_length = n;
+    arg.dest_offset = out_off;
+    return ioctl(out_fd, FICLONERANGE, &arg) == 0;
+#else
+    return false;
+#endif
+}
+#endif
+
+}
+
 BinaryFileStream::BinaryFileStream() noexcept : impl(std::make_unique<Impl>()) {}
 
 BinaryFileStream::~BinaryFileStream() noexcept = default;
@@ -99,6 +195,28 @@ BinaryFileStream::OffsetType BinaryFileStream::getLength() const noexcept
     return impl->fsize;
 }
 
+const unsigned char* BinaryFileStream::view(OffsetType offset, std::size_t n) const noexcept
+{
+    if(!impl->map || offset < 0 || offset > impl->fsize || n > std::uint64_t(impl->fsize - offset)) return nullptr;
+
+    return impl->map + offset;
+}
+
+void BinaryFileStream::adviseSequential(OffsetType offset, OffsetType n) noexcept
+{
+#ifdef MP4JOIN_HAVE_MMAP
+    if(!impl->map || offset < 0 || n <= 0 || offset >= impl->fsize) return;
+
+    // madvise() wants a page-aligned start.
+    const auto page = OffsetType(sysconf(_SC_PAGESIZE));
+    const auto start = page > 0 ? offset / page * page : offset;
+    const auto end = std::min(offset + n, impl->fsize);
+    madvise(const_cast<unsigned char*>(impl->map) + start, std::size_t(end - start), MADV_SEQUENTIAL);
+#else
+    (void)offset; (void)n;
+#endif
+}
+
 bool BinaryFileStream::read(void * buf, std::size_t n) noexcept
 {
     return impl->read(buf, n);
@@ -119,3 +237,154 @@ BinaryFileStream::OffsetType BinaryFileStream::tell() const noexcept
 {
     return impl->tell();
 }
+
+void BinaryFileStream::writeBehind(OffsetType offset, OffsetType n) noexcept
+{
+#ifdef __linux__
+    if(!impl->fp || impl->map || offset < 0 || n <= 0) return;
+    if(fflush(impl->fp) != 0) return;
+
+    sync_file_range(fileno(impl->fp), offset, n, SYNC_FILE_RANGE_WRITE);
+#else
+    (void)offset; (void)n;
+#endif
+}
+
+void BinaryFileStream::dropCache(OffsetType offset, OffsetType n) noexcept
+{
+#ifdef __linux__
+    if(!impl->fp || offset < 0 || n <= 0) return;
+
+    const auto page = OffsetType(sysconf(_SC_PAGESIZE));
+    if(page <= 0) return;
+    const auto start = offset / page * page;
+    const auto end = (offset + n + page - 1) / page * page;
+    const int fd = fileno(impl->fp);
+
+    if(impl->map) {
+        // Pages still mapped into this process would survive the fadvise() below.
+        const auto map_end = std::min(end, (impl->fsize + page - 1) / page * page);
+        if(start < map_end) madvise(const_cast<unsigned char*>(impl->map) + start, std::size_t(map_end - start), MADV_DONTNEED);
+    }
+    else {
+        if(fflush(impl->fp) != 0) return;
+        sync_file_range(fd, start, end - start, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+    posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+#else
+    (void)offset; (void)n;
+#endif
+}
+
+void BinaryFileStream::setIoStats(IoStats* stats) noexcept
+{
+    impl->stats = stats;
+}
+
+IoStats* BinaryFileStream::ioStats() const noexcept
+{
+    return impl->stats;
+}
+
+int BinaryFileStream::nativeHandle() noexcept
+{
+#ifdef _WIN32
+    return -1;
+#else
+    if(!impl->fp || fflush(impl->fp) != 0) return -1;
+
+    return fileno(impl->fp);
+#endif
+}
+
+std::size_t BinaryFileStream::preferredBufferSize() const noexcept
+{
+    constexpr std::size_t fallback = 4*1024*1024;
+#ifdef __linux__
+    struct stat st;
+    if(!impl->fp || fstat(fileno(impl->fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_blksize <= 0) return fallback;
+
+    // Largest request the block device takes, from sysfs. A partition has no queue of its own, its disk's is one level up.
+    const auto read_sysfs = [&](const char* attr) -> unsigned long {
+        for (const char* dir : {"", "/.."}) {
+            char path[96];
+            std::snprintf(path, sizeof path, "/sys/dev/block/%u:%u%s/queue/%s", major(st.st_dev), minor(st.st_dev), dir, attr);
+            FILE* const f = fopen(path, "r");
+            if(!f) continue;
+            unsigned long v = 0;
+            const bool ok = fscanf(f, "%lu", &v) == 1;
+            fclose(f);
+            if(ok) return v;
+        }
+        return 0;
+    };
+    const auto max_kb = read_sysfs("max_sectors_kb");
+    if(max_kb == 0) return fallback; // not a block device, e.g. a network or FUSE file system
+
+    // Enough for several requests in flight at once, twice that for spinning disks, which like long sequential runs.
+    std::size_t size = std::size_t(max_kb) * 1024 * 8;
+    if(read_sysfs("rotational") == 1) size *= 2;
+    size = std::clamp<std::size_t>(size, 1024*1024, 16*1024*1024);
+    const auto blk = std::size_t(st.st_blksize);
+    return (size + blk - 1) / blk * blk;
+#else
+    return fallback;
+#endif
+}
+
+std::size_t BinaryFileStream::transferFrom(BinaryFileStream & in, std::size_t n) noexcept
+{
+#ifdef __linux__
+    auto& src = *in.impl;
+    auto& dst = *impl;
+    if(!src.fp || !dst.fp || !src.kernel_copy || n == 0) return 0;
+
+    // Both stdio buffers must be out of the way: flush pending output, and address the input by offset.
+    if(fflush(dst.fp) != 0) return 0;
+    const off_t in_off = src.tell();
+    const off_t out_off = dst.tell(); // -1 for pipes and sockets, which only sendfile() can feed
+    if(in_off < 0) return 0;
+    const int in_fd = fileno(src.fp);
+    const int out_fd = fileno(dst.fp);
+
+    IoStats* const stats = dst.stats;
+    auto start = stats ? IoStats::Clock::now() : IoStats::Clock::time_point{};
+    std::size_t done = out_off >= 0 && clone_range(in_fd, in_off, out_fd, out_off, n) ? n : 0;
+    if(stats && done) stats->copy(done, start);
+    bool use_sendfile = out_off < 0;
+    while(done < n) {
+        const auto len = std::min(n - done, KERNEL_COPY_CHUNK);
+        off_t src_pos = in_off + done;
+        ssize_t ret;
+        if(stats) start = IoStats::Clock::now();
+        if(!use_sendfile) {
+            off_t dst_pos = out_off + done;
+            ret = copy_file_range(in_fd, &src_pos, out_fd, &dst_pos, len, 0);
+            if(ret < 0 && errno == EINTR) continue;
+            if(ret <= 0) {
+                // e.g. EXDEV or an old kernel. sendfile() writes at the descriptor's own offset.
+                use_sendfile = true;
+                if(stats) stats->seek();
+                if(lseek(out_fd, out_off + done, SEEK_SET) < 0) break;
+                continue;
+            }
+        }
+        else {
+            ret = sendfile(out_fd, in_fd, &src_pos, len);
+            if(ret < 0 && errno == EINTR) continue;
+            if(ret <= 0) break;
+        }
+        if(stats) stats->copy(std::size_t(ret), start);
+        done += ret;
+    }
+
+    if(done < n) src.kernel_copy = false;
+    // Resync the stdio positions with what the kernel did.
+    src.seek(in_off + done, SeekFrom::Begin);
+    if(out_off >= 0) dst.seek(out_off + done, SeekFrom::Begin);
+    return done;
+#else
+    (void)in; (void)n;
+    return 0;
+#endif
+}
@@ -5,6 +5,8 @@
 #include <string>
 #include "binary_stream_base.hpp"
 
+class IoStats;
+
 class BinaryFileStream : public BinaryStream { // Alternatively, derive an impl class from BinaryStreamBase, and BinaryFileStream inherites from the impl class AND BinaryStream class.
 public:
     BinaryFileStream() noexcept;
@@ -12,7 +14,9 @@ public:
 
     enum class OpenMode {
         READ,
-        WRITE
+        WRITE,
+        READ_MMAP, // READ through a memory mapping of the whole file. Falls back to READ where mapping isn't possible.
+        UPDATE     // Read and write an existing file in place, without truncating it.
     };
 
     bool open(const std::string& filename, OpenMode mode = OpenMode::READ) noexcept;
@@ -21,6 +25,37 @@ public:
 
     OffsetType getLength() const noexcept;
 
+    // Direct pointer to n bytes at offset, only available when the file is memory mapped.
+    // Returns nullptr otherwise, or if the range is out of bounds.
+    const unsigned char* view(OffsetType offset, std::size_t n) const noexcept;
+
+    // Hint that [offset, offset+n) is about to be read sequentially. No-op unless memory mapped.
+    void adviseSequential(OffsetType offset, OffsetType n) noexcept;
+
+    // Page cache hints for streaming through files much larger than RAM. No-ops where unsupported.
+    // writeBehind() starts writeback of dirty pages in the range without waiting.
+    // dropCache() waits for any writeback of the range, then evicts it, partial pages at either end included.
+    void writeBehind(OffsetType offset, OffsetType n) noexcept;
+    void dropCache(OffsetType offset, OffsetType n) noexcept;
+
+    // Count the I/O calls on this file in `stats` from now on; nullptr to stop.
+    void setIoStats(IoStats* stats) noexcept;
+    IoStats* ioStats() const noexcept;
+
+    // OS file descriptor behind the stream, with pending buffered output flushed first.
+    // Returns -1 if there is none (not open, or not a POSIX system).
+    int nativeHandle() noexcept;
+
+    // Copy buffer size that suits the device this file is on, for copies into or out of it.
+    // Only Linux block devices are looked at, 4 MiB otherwise.
+    std::size_t preferredBufferSize() const noexcept;
+
+    // Move up to n bytes from `in` without a user-space buffer: FICLONERANGE reflink, copy_file_range or sendfile.
+    // This stream may be a pipe or socket, in which case only sendfile is tried.
+    // Returns the number of bytes moved, both streams are positioned right after them.
+    // A short count means the kernel refused; further calls with the same `in` return 0 immediately.
+    std::size_t transferFrom(BinaryFileStream& in, std::size_t n) noexcept;
+
     virtual bool read(void* buf, std::size_t n) noexcept override;
     virtual bool write(const void* buf, std::size_t n) noexcept override;
     virtual bool seek(OffsetType offset, SeekFrom from = SeekFrom::Begin) noexcept override;
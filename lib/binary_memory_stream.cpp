@@ -0,0 +1,61 @@
+#include "binary_memory_stream.hpp"
+#include <cstring>
+#include <new>
+
+bool BinaryMemoryStream::read(void * dst, std::size_t n) noexcept
+{
+    if(pos > buf.size() || n > buf.size() - pos) return false;
+    if(n == 0) return true;
+
+    std::memcpy(dst, buf.data() + pos, n);
+    pos += n;
+    return true;
+}
+
+bool BinaryMemoryStream::write(const void * src, std::size_t n) noexcept
+{
+    if(n == 0) return true;
+
+    const auto p = extend(n);
+    if(!p) return false;
+    std::memcpy(p, src, n);
+    return true;
+}
+
+unsigned char* BinaryMemoryStream::extend(std::size_t n) noexcept
+{
+    try {
+        if(buf.size() < pos + n) buf.resize(pos + n);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+    const auto p = buf.data() + pos;
+    pos += n;
+    return p;
+}
+
+bool BinaryMemoryStream::copyFrom(BinaryStreamBase & in, std::size_t n) noexcept
+{
+    const auto mark = pos;
+    const auto p = extend(n);
+    if(!p) return false;
+    if(!in.read(p, n)) {
+        pos = mark;
+        return false;
+    }
+    return true;
+}
+
+bool BinaryMemoryStream::seek(OffsetType offset, SeekFrom from) noexcept
+{
+    const OffsetType base = from == SeekFrom::Current ? OffsetType(pos) : from == SeekFrom::End ? OffsetType(buf.size()) : 0;
+    if(base + offset < 0) return false;
+
+    pos = std::size_t(base + offset);
+    return true;
+}
+
+BinaryMemoryStream::OffsetType BinaryMemoryStream::tell() const noexcept
+{
+    return OffsetType(pos);
+}
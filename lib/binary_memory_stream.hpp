@@ -0,0 +1,35 @@
+#ifndef BINARY_MEMORY_STREAM_HPP_3D9E2B71_0C4A_4F8E_A6B5_7E19C2D84F60
+#define BINARY_MEMORY_STREAM_HPP_3D9E2B71_0C4A_4F8E_A6B5_7E19C2D84F60
+
+#include <vector>
+#include "binary_stream_base.hpp"
+
+// Binary stream over a growable in-memory buffer.
+// Seeking past the end is allowed, the gap is zero-filled on the next write.
+class BinaryMemoryStream : public BinaryStream {
+public:
+    virtual bool isOpen() const noexcept override { return true; }
+
+    virtual bool read(void* buf, std::size_t n) noexcept override;
+    virtual bool write(const void* buf, std::size_t n) noexcept override;
+    virtual bool seek(OffsetType offset, SeekFrom from = SeekFrom::Begin) noexcept override;
+    virtual OffsetType tell() const noexcept override;
+
+    // Read n bytes from `in` straight into the buffer at the current position.
+    bool copyFrom(BinaryStreamBase& in, std::size_t n) noexcept;
+
+    // Make room for n bytes at the current position, and advance past them.
+    // The returned pointer is valid until the buffer grows again. Returns nullptr on allocation failure.
+    unsigned char* extend(std::size_t n) noexcept;
+
+    const unsigned char* data() const noexcept { return buf.data(); }
+    unsigned char* data() noexcept { return buf.data(); }
+    std::size_t size() const noexcept { return buf.size(); }
+    void clear() noexcept { buf.clear(); pos = 0; }
+
+private:
+    std::vector<unsigned char> buf;
+    std::size_t pos = 0;
+};
+
+#endif /* BINARY_MEMORY_STREAM_HPP_3D9E2B71_0C4A_4F8E_A6B5_7E19C2D84F60 */
@@ -1,36 +1,31 @@
 #include "binary_stream_base.hpp"
 #include "endian.h"
 #include <memory>
+#include <new>
 #include <cstdint>
 #include <algorithm>
 
 bool BinaryStream::copyFrom(BinaryStreamBase & in, std::size_t n, std::size_t bufsize) noexcept
 {
-    if(!(in.isOpen() && isOpen())) return 0;
-    if(bufsize <= 0 || n <= 0) return 0;
-
-    const auto nb_blocks = n / bufsize;
-    const auto rem_bytes = n % bufsize;
-    //std::size_t blocks_written = 0;
-
-    const auto buf = std::make_unique<unsigned char[]>(bufsize);
-
-    for(std::size_t i = 0; i<nb_blocks; ++i) {
-        if(!in.read(buf.get(), bufsize)) {
-            return false;
-        }
-        if(!write(buf.get(), bufsize)) {
-            return false;
-        }
-    }
+    if(bufsize == 0 || n == 0) return false;
 
-    if(!in.read(buf.get(), rem_bytes)) {
-        return false;
-    }
-    if(!write(buf.get(), rem_bytes)) {
-        return false;
-    }
+    // No bigger than the copy, and left uninitialized: small boxes shouldn't cost a zeroed 4 MiB each.
+    const auto size = std::min(n, bufsize);
+    const std::unique_ptr<unsigned char[]> buf(new (std::nothrow) unsigned char[size]);
+    if(!buf) return false;
+    return copyFrom(in, n, buf.get(), size);
+}
 
+bool BinaryStream::copyFrom(BinaryStreamBase & in, std::size_t n, unsigned char* buf, std::size_t bufsize) noexcept
+{
+    if(!(in.isOpen() && isOpen())) return false;
+    if(!buf || bufsize == 0 || n == 0) return false;
+
+    for(std::size_t done = 0; done < n; ) {
+        const auto len = std::min(n - done, bufsize);
+        if(!in.read(buf, len) || !write(buf, len)) return false;
+        done += len;
+    }
     return true;
 }
 
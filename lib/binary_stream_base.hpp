@@ -37,7 +37,10 @@ public:
         NE = 2
     };
 
+    // Copy n bytes from the current position of `in`, through a buffer of up to `bufsize` bytes allocated for the purpose.
     bool copyFrom(BinaryStreamBase& in, std::size_t n, std::size_t bufsize = 1024*1024*4) noexcept;
+    // Same, through the caller's `buf` of `bufsize` bytes. For callers that copy over and over, e.g. with a BufferPool.
+    bool copyFrom(BinaryStreamBase& in, std::size_t n, unsigned char* buf, std::size_t bufsize) noexcept;
     bool patchBytes(OffsetType offset, const void* buf, std::size_t n) noexcept;
 
     template <Endian endian=Endian::BE, typename IntT, unsigned BytesToRead = sizeof(IntT),
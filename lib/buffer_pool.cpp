@@ -0,0 +1,98 @@
+#include "buffer_pool.hpp"
+#include <algorithm>
+#include <new>
+#include <utility>
+
+#if !defined(_WIN32) && __has_include(<sys/mman.h>)
+#  include <sys/mman.h>
+#  define MP4JOIN_HAVE_MMAP
+#endif
+
+namespace {
+
+// Alignment where pages can't be mapped directly. Suits O_DIRECT and 4 KiB pages alike.
+constexpr std::size_t buffer_alignment = 4096;
+
+#ifdef __linux__
+// Transparent huge pages only pay off for buffers spanning at least one.
+constexpr std::size_t huge_page_size = std::size_t(2) << 20;
+#endif
+
+}
+
+AlignedBuffer::AlignedBuffer(std::size_t size, bool huge_pages) noexcept
+{
+    if (size == 0) return;
+#ifdef MP4JOIN_HAVE_MMAP
+    void* const m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) return;
+    p = static_cast<unsigned char*>(m);
+#  if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (huge_pages && size >= huge_page_size) madvise(m, size, MADV_HUGEPAGE); // just a hint
+#  endif
+#else
+    p = static_cast<unsigned char*>(::operator new(size, std::align_val_t(buffer_alignment), std::nothrow));
+    if (!p) return;
+#endif
+    (void)huge_pages;
+    len = size;
+}
+
+AlignedBuffer::AlignedBuffer(AlignedBuffer&& other) noexcept
+    : p(std::exchange(other.p, nullptr)), len(std::exchange(other.len, 0)) {}
+
+AlignedBuffer& AlignedBuffer::operator=(AlignedBuffer&& other) noexcept
+{
+    if (this != &other) {
+        free();
+        p = std::exchange(other.p, nullptr);
+        len = std::exchange(other.len, 0);
+    }
+    return *this;
+}
+
+AlignedBuffer::~AlignedBuffer() noexcept
+{
+    free();
+}
+
+void AlignedBuffer::free() noexcept
+{
+    if (!p) return;
+#ifdef MP4JOIN_HAVE_MMAP
+    munmap(p, len);
+#else
+    ::operator delete(p, std::align_val_t(buffer_alignment));
+#endif
+    p = nullptr;
+    len = 0;
+}
+
+
+AlignedBuffer BufferPool::acquire(std::size_t size) noexcept
+{
+    {
+        std::lock_guard lock(m);
+        const auto it = std::find_if(free_list.begin(), free_list.end(), [&](const AlignedBuffer& b) { return b.size() == size; });
+        if (it != free_list.end()) {
+            auto buf = std::move(*it);
+            free_list.erase(it);
+            kept -= size;
+            return buf;
+        }
+    }
+    return AlignedBuffer(size, huge_pages);
+}
+
+void BufferPool::release(AlignedBuffer buf) noexcept
+{
+    if (!buf) return;
+    std::lock_guard lock(m);
+    if (kept + buf.size() > max_kept) return; // freed on the way out
+    try {
+        free_list.push_back(std::move(buf));
+    } catch (const std::bad_alloc&) {
+        return;
+    }
+    kept += free_list.back().size();
+}
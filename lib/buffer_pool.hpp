@@ -0,0 +1,67 @@
+#ifndef BUFFER_POOL_HPP_6D0F2B81_C4A7_4E39_9B15_E83A7C5D2F46
+#define BUFFER_POOL_HPP_6D0F2B81_C4A7_4E39_9B15_E83A7C5D2F46
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Page-aligned copy buffer. Linux can back it with transparent huge pages.
+class AlignedBuffer {
+public:
+    AlignedBuffer() noexcept = default;
+    AlignedBuffer(std::size_t size, bool huge_pages) noexcept; // empty on failure
+    AlignedBuffer(AlignedBuffer&& other) noexcept;
+    AlignedBuffer& operator=(AlignedBuffer&& other) noexcept;
+    ~AlignedBuffer() noexcept;
+
+    unsigned char* data() const noexcept { return p; }
+    std::size_t size() const noexcept { return len; }
+    explicit operator bool() const noexcept { return p; }
+
+private:
+    void free() noexcept;
+
+    unsigned char* p = nullptr;
+    std::size_t len = 0;
+};
+
+// Buffers handed back by one copy, for the next one to pick up again, already faulted in.
+// Thread-safe, so that concurrent joins can share it.
+class BufferPool {
+public:
+    explicit BufferPool(bool huge_pages = false, std::size_t max_kept = std::size_t(256) << 20) noexcept
+        : huge_pages(huge_pages), max_kept(max_kept) {}
+
+    // A kept buffer of exactly `size` bytes if there is one, a new one otherwise. Empty on failure.
+    AlignedBuffer acquire(std::size_t size) noexcept;
+    // Keep `buf` for later, unless that would keep more than `max_kept` bytes in total.
+    void release(AlignedBuffer buf) noexcept;
+
+private:
+    const bool huge_pages;
+    const std::size_t max_kept;
+    std::size_t kept = 0;
+    std::vector<AlignedBuffer> free_list;
+    std::mutex m;
+};
+
+// A buffer borrowed from a pool (or of its own, without one) for as long as this lives.
+class PooledBuffer {
+public:
+    PooledBuffer(BufferPool* pool, std::size_t size) noexcept
+        : pool(pool), buf(pool ? pool->acquire(size) : AlignedBuffer(size, false)) {}
+    ~PooledBuffer() noexcept { if (pool) pool->release(std::move(buf)); }
+
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    unsigned char* data() const noexcept { return buf.data(); }
+    std::size_t size() const noexcept { return buf.size(); }
+    explicit operator bool() const noexcept { return bool(buf); }
+
+private:
+    BufferPool* const pool;
+    AlignedBuffer buf;
+};
+
+#endif /* BUFFER_POOL_HPP_6D0F2B81_C4A7_4E39_9B15_E83A7C5D2F46 */
@@ -0,0 +1,55 @@
+#ifndef BYTE_ORDER_HPP_6A0F3C1E_2B7D_4E59_9C84_D31E5B7A0F42
+#define BYTE_ORDER_HPP_6A0F3C1E_2B7D_4E59_9C84_D31E5B7A0F42
+
+#include "endian.h"
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Unaligned big-endian loads and stores on raw memory.
+// These are kept trivially inlinable, so that loops over whole tables get vectorized by the compiler.
+
+namespace mp4join {
+
+template <typename T>
+constexpr T byteswap(T x) noexcept
+{
+    static_assert(std::is_unsigned_v<T>, "byteswap() takes unsigned integers");
+    if constexpr (sizeof(T) == 1) {
+        return x;
+    }
+    else {
+        T r = 0;
+        for (unsigned i = 0; i < sizeof(T); ++i) {
+            r = T(r << 8) | T(x & 0xFF);
+            x = T(x >> 8);
+        }
+        return r;
+    }
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+template <> constexpr std::uint16_t byteswap(std::uint16_t x) noexcept { return __builtin_bswap16(x); }
+template <> constexpr std::uint32_t byteswap(std::uint32_t x) noexcept { return __builtin_bswap32(x); }
+template <> constexpr std::uint64_t byteswap(std::uint64_t x) noexcept { return __builtin_bswap64(x); }
+#endif
+
+template <typename T>
+inline T loadBE(const unsigned char* p) noexcept
+{
+    T x;
+    std::memcpy(&x, p, sizeof(T));
+    if constexpr (MP4JOIN_ENDIAN == MP4JOIN_LITTLE_ENDIAN) x = byteswap(x);
+    return x;
+}
+
+template <typename T>
+inline void storeBE(unsigned char* p, T x) noexcept
+{
+    if constexpr (MP4JOIN_ENDIAN == MP4JOIN_LITTLE_ENDIAN) x = byteswap(x);
+    std::memcpy(p, &x, sizeof(T));
+}
+
+}
+
+#endif /* BYTE_ORDER_HPP_6A0F3C1E_2B7D_4E59_9C84_D31E5B7A0F42 */
@@ -0,0 +1,182 @@
+#include "copy_pipeline.hpp"
+#include <new>
+#include <system_error>
+
+namespace {
+
+// Read `extents` back to back into buffers of `bufsize` bytes, filling each one up before moving on to the next.
+// `next()` gives the buffer to fill, nullptr to stop. `done(n)` takes it back with `n` bytes in it, false to stop.
+template <typename Next, typename Done>
+bool
+gather(const std::vector<CopyExtent>& extents, std::size_t bufsize, Next next, Done done) noexcept
+{
+    unsigned char* buf = nullptr;
+    std::size_t used = 0;
+    const BinaryStreamBase* at_src = nullptr; // where the previous extent ended, to skip needless seeks
+    SeekableStream::OffsetType at = 0;
+    for (const auto& e : extents) {
+        if ((e.src != at_src || e.offset != at) && !e.src->seek(e.offset)) return false;
+        for (std::uint64_t remaining = e.size; remaining > 0;) {
+            if (!buf && !(buf = next())) return false;
+            const auto n = remaining < bufsize - used ? std::size_t(remaining) : bufsize - used;
+            if (!e.src->read(buf + used, n)) return false;
+            used += n;
+            remaining -= n;
+            if (used == bufsize) {
+                if (!done(used)) return false;
+                buf = nullptr;
+                used = 0;
+            }
+        }
+        at_src = e.src;
+        at = e.offset + SeekableStream::OffsetType(e.size);
+    }
+    return !buf || done(used);
+}
+
+}
+
+CopyPipeline::CopyPipeline(std::size_t bufsize, std::size_t nb_buffers, BufferPool* pool) noexcept
+    : bufsize(bufsize), pool(pool)
+{
+    try {
+        slots.resize(nb_buffers);
+    } catch (const std::bad_alloc&) {} // copy() fails then
+}
+
+CopyPipeline::~CopyPipeline() noexcept
+{
+    if (reader.joinable()) {
+        {
+            std::lock_guard lock(m);
+            stopping = true;
+            cv.notify_all();
+        }
+        reader.join();
+    }
+    if (pool) {
+        for (auto& slot : slots) pool->release(std::move(slot.data));
+    }
+}
+
+AlignedBuffer& CopyPipeline::buffer(Slot& slot) noexcept
+{
+    if (!slot.data) slot.data = pool ? pool->acquire(bufsize) : AlignedBuffer(bufsize, false);
+    return slot.data;
+}
+
+// Reader thread: waits for a job, reads it into the slots, and waits for the next one.
+void CopyPipeline::read() noexcept
+{
+    std::unique_lock lock(m);
+    for (;;) {
+        cv.wait(lock, [&] { return (job && !reader_done) || stopping; });
+        if (stopping) return;
+        const auto& extents = *job;
+        lock.unlock();
+        const bool ok = readExtents(extents);
+        lock.lock();
+        if (!ok) failed = true;
+        reader_done = true;
+        cv.notify_all();
+    }
+}
+
+// Producer side: read all extents into free slots.
+bool CopyPipeline::readExtents(const std::vector<CopyExtent>& extents) noexcept
+{
+    const auto nb_slots = slots.size();
+    std::size_t tail = 0; // next slot to fill, every job starts with an empty ring
+    return gather(extents, bufsize,
+        [&]() -> unsigned char* {
+            {
+                std::unique_lock lock(m);
+                cv.wait(lock, [&] { return filled < nb_slots || failed; });
+                if (failed) return nullptr;
+            }
+            // Not in use by the writer until `filled` says so.
+            return buffer(slots[tail]).data();
+        },
+        [&](std::size_t n) {
+            slots[tail].size = n;
+            std::lock_guard lock(m);
+            ++filled;
+            cv.notify_all();
+            tail = (tail + 1) % nb_slots;
+            return true;
+        });
+}
+
+bool CopyPipeline::copyInline(BinaryStreamBase& dst, const std::vector<CopyExtent>& extents,
+                              const std::function<bool(std::size_t)>& on_written) noexcept
+{
+    const auto& buf = buffer(slots.front());
+    if (!buf) return false;
+    return gather(extents, bufsize,
+        [&] { return buf.data(); },
+        [&](std::size_t n) { return dst.write(buf.data(), n) && (!on_written || on_written(n)); });
+}
+
+bool CopyPipeline::copy(BinaryStreamBase& dst, const std::vector<CopyExtent>& extents,
+                        const std::function<bool(std::size_t)>& on_written) noexcept
+{
+    if (bufsize == 0 || slots.empty()) return false;
+
+    // Within a single buffer, there's no reading and writing to overlap. Handing it over to the reader would only add latency.
+    std::uint64_t total = 0;
+    for (const auto& e : extents) total += e.size;
+    if (total <= bufsize) return copyInline(dst, extents, on_written);
+
+    if (!reader.joinable() && !threadless) {
+        try {
+            reader = std::thread(&CopyPipeline::read, this);
+        } catch (const std::system_error&) {
+            threadless = true;
+        }
+    }
+    if (threadless) return copyInline(dst, extents, on_written);
+
+    {
+        std::lock_guard lock(m);
+        job = &extents;
+        head = 0;
+        filled = 0;
+        reader_done = false;
+        failed = false;
+        cv.notify_all();
+    }
+
+    // Consumer side: write out filled slots in order.
+    for (;;) {
+        {
+            std::unique_lock lock(m);
+            cv.wait(lock, [&] { return filled > 0 || reader_done || failed; });
+            if (failed || filled == 0) break; // error, or all done
+        }
+        const auto& slot = slots[head];
+        const bool ok = dst.write(slot.data.data(), slot.size) && (!on_written || on_written(slot.size));
+
+        std::lock_guard lock(m);
+        if (ok) {
+            --filled;
+            head = (head + 1) % slots.size();
+        }
+        else failed = true;
+        cv.notify_all();
+        if (!ok) break;
+    }
+
+    // The reader may still be at it after a failure, and `extents` must outlive that.
+    std::unique_lock lock(m);
+    cv.wait(lock, [&] { return reader_done; });
+    job = nullptr;
+    return !failed;
+}
+
+bool pipelined_copy(BinaryStreamBase& dst, const std::vector<CopyExtent>& extents,
+                    std::size_t bufsize, std::size_t nb_buffers,
+                    const std::function<bool(std::size_t)>& on_written, BufferPool* pool) noexcept
+{
+    CopyPipeline pipeline(bufsize, nb_buffers, pool);
+    return pipeline.copy(dst, extents, on_written);
+}
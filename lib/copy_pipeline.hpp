@@ -0,0 +1,69 @@
+#ifndef COPY_PIPELINE_HPP_8C5B0E4D_71A2_4B3F_9E6D_0A4F2C7B91E3
+#define COPY_PIPELINE_HPP_8C5B0E4D_71A2_4B3F_9E6D_0A4F2C7B91E3
+
+#include "binary_stream_base.hpp"
+#include "buffer_pool.hpp"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A contiguous byte range of some input stream.
+struct CopyExtent {
+    BinaryStreamBase* src;
+    SeekableStream::OffsetType offset;
+    std::uint64_t size;
+};
+
+// Copies extents to an output: a reader thread fills a ring of `nb_buffers` buffers of `bufsize` bytes,
+// while the calling thread drains them into the output. Every buffer is filled up across extents before it's written,
+// so that many small extents make few writes. The reader thread and the buffers are kept from one copy() to the next.
+class CopyPipeline {
+public:
+    // The buffers are taken from `pool` (optional), and handed back to it when the pipeline goes.
+    CopyPipeline(std::size_t bufsize, std::size_t nb_buffers, BufferPool* pool = nullptr) noexcept;
+    ~CopyPipeline() noexcept;
+
+    CopyPipeline(const CopyPipeline&) = delete;
+    CopyPipeline& operator=(const CopyPipeline&) = delete;
+
+    // Copy `extents` to the current position of `dst`, in order. Reading runs ahead of writing, across extent boundaries.
+    // `on_written` (optional) is called with the byte count of every buffer written. Returning false stops the copy, which then fails.
+    bool copy(BinaryStreamBase& dst, const std::vector<CopyExtent>& extents,
+              const std::function<bool(std::size_t)>& on_written = {}) noexcept;
+
+private:
+    struct Slot {
+        AlignedBuffer data;
+        std::size_t size = 0;
+    };
+
+    void read() noexcept;
+    bool readExtents(const std::vector<CopyExtent>& extents) noexcept;
+    bool copyInline(BinaryStreamBase& dst, const std::vector<CopyExtent>& extents, const std::function<bool(std::size_t)>& on_written) noexcept;
+    AlignedBuffer& buffer(Slot& slot) noexcept;
+
+    const std::size_t bufsize;
+    BufferPool* const pool;
+    std::vector<Slot> slots;
+    std::thread reader;
+    bool threadless = false;                       // no thread to spare: copy() reads and writes through a single buffer
+
+    // Shared with the reader thread, under `m`.
+    const std::vector<CopyExtent>* job = nullptr;  // extents to read, until the reader is done with them
+    std::size_t head = 0;                          // next slot to write out
+    std::size_t filled = 0;                        // slots ready to be written
+    bool reader_done = false;                      // all of `job` is in the slots, or failed
+    bool failed = false;
+    bool stopping = false;
+    std::mutex m;
+    std::condition_variable cv;
+};
+
+// Copy `extents` to the current position of `dst`, in order, through a CopyPipeline of its own.
+bool pipelined_copy(BinaryStreamBase& dst, const std::vector<CopyExtent>& extents,
+                    std::size_t bufsize, std::size_t nb_buffers,
+                    const std::function<bool(std::size_t)>& on_written = {}, BufferPool* pool = nullptr) noexcept;
+
+#endif /* COPY_PIPELINE_HPP_8C5B0E4D_71A2_4B3F_9E6D_0A4F2C7B91E3 */
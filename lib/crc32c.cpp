@@ -0,0 +1,113 @@
+#include "crc32c.hpp"
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  include <nmmintrin.h>
+#  define MP4JOIN_CRC32C_SSE42 __attribute__((target("sse4.2")))
+#elif defined(_M_X64)
+#  include <intrin.h>
+#  include <nmmintrin.h>
+#  define MP4JOIN_CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#  include <arm_acle.h>
+#  define MP4JOIN_CRC32C_ARM
+#endif
+
+namespace {
+
+constexpr std::uint32_t polynomial = 0x82F63B78; // reversed
+
+// Slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k zero bytes.
+constexpr auto table = [] {
+    std::array<std::array<std::uint32_t, 256>, 8> t{};
+    for (std::uint32_t b = 0; b < 256; ++b) {
+        auto c = b;
+        for (int i = 0; i < 8; ++i) c = c & 1 ? (c >> 1) ^ polynomial : c >> 1;
+        t[0][b] = c;
+    }
+    for (std::size_t k = 1; k < 8; ++k) {
+        for (std::size_t b = 0; b < 256; ++b) t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xFF];
+    }
+    return t;
+}();
+
+// Little-endian 64-bit load, whatever the host.
+std::uint64_t
+load_le64(const unsigned char* p) noexcept
+{
+    std::uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) v = v << 8 | p[i];
+    return v;
+}
+
+// `crc` is in its inverted, running form here and below.
+std::uint32_t
+crc32c_sw(std::uint32_t crc, const unsigned char* p, std::size_t n) noexcept
+{
+    for (; n >= 8; p += 8, n -= 8) {
+        const auto v = load_le64(p) ^ crc;
+        crc = table[7][v & 0xFF] ^ table[6][(v >> 8) & 0xFF] ^ table[5][(v >> 16) & 0xFF] ^ table[4][(v >> 24) & 0xFF]
+            ^ table[3][(v >> 32) & 0xFF] ^ table[2][(v >> 40) & 0xFF] ^ table[1][(v >> 48) & 0xFF] ^ table[0][v >> 56];
+    }
+    for (; n; ++p, --n) crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xFF];
+    return crc;
+}
+
+#ifdef MP4JOIN_CRC32C_SSE42
+MP4JOIN_CRC32C_SSE42 std::uint32_t
+crc32c_hw(std::uint32_t crc, const unsigned char* p, std::size_t n) noexcept
+{
+    std::uint64_t c = crc;
+    for (; n >= 8; p += 8, n -= 8) {
+        std::uint64_t v;
+        std::memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    auto c32 = std::uint32_t(c);
+    for (; n; ++p, --n) c32 = _mm_crc32_u8(c32, *p);
+    return c32;
+}
+
+bool
+have_hw() noexcept
+{
+#  ifdef _M_X64
+    int info[4];
+    __cpuid(info, 1);
+    return info[2] & (1 << 20);
+#  else
+    return __builtin_cpu_supports("sse4.2");
+#  endif
+}
+#elif defined(MP4JOIN_CRC32C_ARM)
+std::uint32_t
+crc32c_hw(std::uint32_t crc, const unsigned char* p, std::size_t n) noexcept
+{
+    for (; n >= 8; p += 8, n -= 8) {
+        std::uint64_t v;
+        std::memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    for (; n; ++p, --n) crc = __crc32cb(crc, *p);
+    return crc;
+}
+
+bool
+have_hw() noexcept
+{
+    return true;
+}
+#endif
+
+}
+
+std::uint32_t crc32c(std::uint32_t crc, const void* data, std::size_t n) noexcept
+{
+    const auto* const p = static_cast<const unsigned char*>(data);
+#if defined(MP4JOIN_CRC32C_SSE42) || defined(MP4JOIN_CRC32C_ARM)
+    static const bool hw = have_hw();
+    if (hw) return ~crc32c_hw(~crc, p, n);
+#endif
+    return ~crc32c_sw(~crc, p, n);
+}
@@ -0,0 +1,11 @@
+#ifndef CRC32C_HPP_8E41C6A2_3D57_4B90_A1F8_62C0D9E47B15
+#define CRC32C_HPP_8E41C6A2_3D57_4B90_A1F8_62C0D9E47B15
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli) of `n` bytes at `data`, continuing from `crc`, the CRC-32C of what came before (0 to begin with).
+// Uses the CPU's CRC-32C instructions where there are any: SSE 4.2 on x86-64, checked at run time, and ARMv8 CRC.
+std::uint32_t crc32c(std::uint32_t crc, const void* data, std::size_t n) noexcept;
+
+#endif /* CRC32C_HPP_8E41C6A2_3D57_4B90_A1F8_62C0D9E47B15 */
@@ -0,0 +1,99 @@
+#include "mp4join/io.hpp"
+#include <cstring>
+#include <utility>
+
+using namespace mp4join;
+
+MemoryInput::MemoryInput(const void* data, std::size_t size) noexcept
+    : ptr(static_cast<const unsigned char*>(data)), len(size) {}
+
+InputStream::OffsetType MemoryInput::size() const noexcept
+{
+    return OffsetType(len);
+}
+
+bool MemoryInput::read(void* buf, std::size_t n) noexcept
+{
+    if (n > len - pos) return false;
+    if (n) std::memcpy(buf, ptr + pos, n);
+    pos += n;
+    return true;
+}
+
+bool MemoryInput::seek(OffsetType offset) noexcept
+{
+    if (offset < 0 || std::size_t(offset) > len) return false;
+    pos = std::size_t(offset);
+    return true;
+}
+
+InputStream::OffsetType MemoryInput::tell() const noexcept
+{
+    return OffsetType(pos);
+}
+
+const unsigned char* MemoryInput::data() const noexcept
+{
+    return ptr;
+}
+
+
+CallbackInput::CallbackInput(OffsetType size, ReadFn read_fn) noexcept
+    : fn(std::move(read_fn)), len(size) {}
+
+InputStream::OffsetType CallbackInput::size() const noexcept
+{
+    return len;
+}
+
+bool CallbackInput::read(void* buf, std::size_t n) noexcept
+{
+    if (OffsetType(n) > len - pos) return false;
+    try {
+        if (n && !fn(buf, n, pos)) return false;
+    } catch (...) {
+        return false;
+    }
+    pos += OffsetType(n);
+    return true;
+}
+
+bool CallbackInput::seek(OffsetType offset) noexcept
+{
+    if (offset < 0 || offset > len) return false;
+    pos = offset;
+    return true;
+}
+
+InputStream::OffsetType CallbackInput::tell() const noexcept
+{
+    return pos;
+}
+
+
+MemoryOutput::MemoryOutput(std::vector<unsigned char>& buf) noexcept
+    : dest(buf) {}
+
+bool MemoryOutput::write(const void* buf, std::size_t n) noexcept
+{
+    const auto p = static_cast<const unsigned char*>(buf);
+    try {
+        dest.insert(dest.end(), p, p + n);
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
+
+CallbackOutput::CallbackOutput(WriteFn write_fn) noexcept
+    : fn(std::move(write_fn)) {}
+
+bool CallbackOutput::write(const void* buf, std::size_t n) noexcept
+{
+    try {
+        return !n || fn(buf, n);
+    } catch (...) {
+        return false;
+    }
+}
@@ -0,0 +1,122 @@
+#include "io_stats.hpp"
+#include "mp4join/mp4join.hpp"
+#include <ctime>
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#endif
+
+namespace {
+
+// CPU time of the whole process so far, all threads included.
+std::chrono::nanoseconds
+process_cpu_time() noexcept
+{
+#if defined(_WIN32)
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) return {};
+    const auto ticks = [](const FILETIME& t) { return (std::uint64_t(t.dwHighDateTime) << 32 | t.dwLowDateTime); };
+    return std::chrono::nanoseconds((ticks(kernel) + ticks(user)) * 100); // in units of 100 ns
+#elif defined(CLOCK_PROCESS_CPUTIME_ID)
+    timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) return {};
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+#else
+    return std::chrono::nanoseconds(std::int64_t(double(std::clock()) / CLOCKS_PER_SEC * 1e9));
+#endif
+}
+
+double
+seconds(std::chrono::nanoseconds d) noexcept
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+}
+
+void IoStats::begin(Phase p) noexcept
+{
+    if (running) end();
+    phase.store(p, std::memory_order_relaxed);
+    running = true;
+    wall_start = Clock::now();
+    cpu_start = process_cpu_time();
+}
+
+void IoStats::end() noexcept
+{
+    if (!running) return;
+    running = false;
+    auto& c = current();
+    c.wall += Clock::now() - wall_start;
+    c.cpu += process_cpu_time() - cpu_start;
+}
+
+void IoStats::latency(Clock::time_point start) noexcept
+{
+    const auto us = std::uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count());
+    std::size_t bucket = 0;
+    for (auto v = us; v && bucket + 1 < nb_buckets; v >>= 1) ++bucket;
+    current().latency[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void IoStats::read(std::uint64_t bytes, Clock::time_point start) noexcept
+{
+    auto& c = current();
+    c.bytes_read.fetch_add(bytes, std::memory_order_relaxed);
+    c.reads.fetch_add(1, std::memory_order_relaxed);
+    latency(start);
+}
+
+void IoStats::write(std::uint64_t bytes, Clock::time_point start) noexcept
+{
+    auto& c = current();
+    c.bytes_written.fetch_add(bytes, std::memory_order_relaxed);
+    c.writes.fetch_add(1, std::memory_order_relaxed);
+    latency(start);
+}
+
+void IoStats::copy(std::uint64_t bytes, Clock::time_point start) noexcept
+{
+    auto& c = current();
+    c.bytes_read.fetch_add(bytes, std::memory_order_relaxed);
+    c.bytes_written.fetch_add(bytes, std::memory_order_relaxed);
+    c.copies.fetch_add(1, std::memory_order_relaxed);
+    latency(start);
+}
+
+void IoStats::seek() noexcept
+{
+    current().seeks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void IoStats::mappedRead(std::uint64_t bytes) noexcept
+{
+    current().bytes_read.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void IoStats::tables(std::uint64_t bytes) noexcept
+{
+    auto peak = peak_tables.load(std::memory_order_relaxed);
+    while (bytes > peak && !peak_tables.compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) {}
+}
+
+void IoStats::get(mp4join::JoinStats& stats) const noexcept
+{
+    mp4join::JoinStats::PhaseStats* const out[NbPhases] = {&stats.validate, &stats.merge, &stats.moov, &stats.mdat};
+    for (int i = 0; i < NbPhases; ++i) {
+        const auto& c = phases[i];
+        auto& s = *out[i];
+        s.wall_seconds = seconds(c.wall);
+        s.cpu_seconds = seconds(c.cpu);
+        s.bytes_read = c.bytes_read.load(std::memory_order_relaxed);
+        s.bytes_written = c.bytes_written.load(std::memory_order_relaxed);
+        s.reads = c.reads.load(std::memory_order_relaxed);
+        s.writes = c.writes.load(std::memory_order_relaxed);
+        s.copies = c.copies.load(std::memory_order_relaxed);
+        s.seeks = c.seeks.load(std::memory_order_relaxed);
+        for (std::size_t b = 0; b < nb_buckets; ++b) s.latency[b] = c.latency[b].load(std::memory_order_relaxed);
+    }
+    stats.peak_table_bytes = peak_tables.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,70 @@
+#ifndef IO_STATS_HPP_2B7E5D19_A6C3_4F08_91D4_C85E3A0F6B27
+#define IO_STATS_HPP_2B7E5D19_A6C3_4F08_91D4_C85E3A0F6B27
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace mp4join {
+struct JoinStats;
+}
+
+// The counters behind JoinOptions::stats, shared by the streams of one join. Thread-safe.
+// I/O counts towards the current phase. Phases run one after another, though each may use many threads.
+class IoStats {
+public:
+    using Clock = std::chrono::steady_clock;
+    enum Phase { Validate, Merge, Moov, Mdat, NbPhases };
+    static constexpr std::size_t nb_buckets = 24; // see JoinStats::PhaseStats::latency
+
+    // Make `phase` the current one, and time it until end().
+    void begin(Phase phase) noexcept;
+    void end() noexcept;
+
+    // Record one call that started at `start`.
+    void read(std::uint64_t bytes, Clock::time_point start) noexcept;
+    void write(std::uint64_t bytes, Clock::time_point start) noexcept;
+    void copy(std::uint64_t bytes, Clock::time_point start) noexcept; // in-kernel copy, the bytes count as read and as written
+    void seek() noexcept;
+    // Bytes read in place from memory, e.g. a memory mapping, which takes no calls at all.
+    void mappedRead(std::uint64_t bytes) noexcept;
+
+    // The sample tables take `bytes` at this point.
+    void tables(std::uint64_t bytes) noexcept;
+
+    void get(mp4join::JoinStats& stats) const noexcept;
+
+private:
+    struct Counters {
+        std::atomic<std::uint64_t> bytes_read{0}, bytes_written{0};
+        std::atomic<std::uint64_t> reads{0}, writes{0}, copies{0}, seeks{0};
+        std::array<std::atomic<std::uint64_t>, nb_buckets> latency{};
+        std::chrono::nanoseconds wall{}, cpu{}; // only touched by begin() and end()
+    };
+
+    Counters& current() noexcept { return phases[phase.load(std::memory_order_relaxed)]; }
+    void latency(Clock::time_point start) noexcept;
+
+    std::array<Counters, NbPhases> phases;
+    std::atomic<int> phase{Validate};
+    bool running = false;
+    Clock::time_point wall_start;
+    std::chrono::nanoseconds cpu_start{};
+    std::atomic<std::uint64_t> peak_tables{0};
+};
+
+// Makes `phase` the current one of `stats` (if any) for as long as this lives.
+class PhaseScope {
+public:
+    PhaseScope(IoStats* stats, IoStats::Phase phase) noexcept : stats(stats) { if (stats) stats->begin(phase); }
+    ~PhaseScope() noexcept { if (stats) stats->end(); }
+
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
+
+private:
+    IoStats* const stats;
+};
+
+#endif /* IO_STATS_HPP_2B7E5D19_A6C3_4F08_91D4_C85E3A0F6B27 */
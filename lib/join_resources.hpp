@@ -0,0 +1,25 @@
+#ifndef JOIN_RESOURCES_HPP_3E9A41C7_0B6D_4F28_A5C3_7D12E8B4F609
+#define JOIN_RESOURCES_HPP_3E9A41C7_0B6D_4F28_A5C3_7D12E8B4F609
+
+#include "mp4join/mp4join.hpp"
+#include "buffer_pool.hpp"
+#include "io_stats.hpp"
+
+namespace mp4join {
+
+// What a join may borrow from whoever runs it, e.g. a JoinSession running many joins side by side.
+struct JoinResources {
+    unsigned max_threads = 0;     // Threads for scanning the inputs, the calling one included. 0 for one per hardware thread.
+    BufferPool* pool = nullptr;   // Where copy buffers come from. The join uses a pool of its own without one.
+    std::size_t bufsize = 0;      // Copy buffer size. 0 to tune it to the output device, see BinaryFileStream::preferredBufferSize().
+    IoStats* stats = nullptr;     // Counters for JoinOptions::stats. Always set by the join itself.
+};
+
+// mp4_join() on input files, with `resources`.
+JoinResult join_files(int nb_input, const char* const* input_files, const char* output_file, const JoinOptions& options,
+                      const JoinProgCb& prog_cb, const JoinResources& resources) noexcept;
+
+}
+
+
+#endif /* JOIN_RESOURCES_HPP_3E9A41C7_0B6D_4F28_A5C3_7D12E8B4F609 */
@@ -0,0 +1,160 @@
+#include "mp4join/mp4join.hpp"
+#include "join_resources.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+
+#ifndef _WIN32
+#  include <sys/stat.h>
+#endif
+
+using namespace mp4join;
+
+namespace {
+
+// Storage device `path` is on, or that of its directory if it doesn't exist yet.
+// Only needs to tell devices apart. Empty if unknown.
+std::string
+device_of(const std::string& path)
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    auto p = fs::absolute(path, ec);
+    if (ec) return {};
+#ifdef _WIN32
+    return p.root_name().string(); // drive letter or UNC share
+#else
+    for (;;) {
+        struct stat st;
+        if (::stat(p.c_str(), &st) == 0) return std::to_string(st.st_dev);
+        if (!p.has_relative_path()) return {};
+        p = p.parent_path();
+    }
+#endif
+}
+
+} // unnamed ns
+
+struct JoinSession::Impl {
+    struct Pending {
+        JoinJob job;
+        JoinDoneCb done_cb;
+        std::vector<std::string> devices; // distinct devices the job reads from or writes to
+    };
+
+    SessionOptions options;
+    BufferPool pools[2] = {BufferPool(false), BufferPool(true)}; // without and with JoinOptions::huge_pages
+    std::vector<std::thread> workers;
+    std::deque<Pending> queue;
+    std::map<std::string, unsigned> busy; // running jobs per device
+    std::size_t unfinished = 0;           // queued or running
+    bool stopping = false;
+    std::mutex m;
+    std::condition_variable cv;
+
+    // Whether `p` may start now. Called with `m` held.
+    bool canStart(const Pending& p) const noexcept {
+        return std::all_of(p.devices.begin(), p.devices.end(), [&](const std::string& d) {
+            const auto it = busy.find(d);
+            return it == busy.end() || it->second < options.max_jobs_per_device;
+        });
+    }
+
+    void work() noexcept {
+        std::unique_lock lock(m);
+        for (;;) {
+            auto it = queue.end();
+            cv.wait(lock, [&] {
+                it = std::find_if(queue.begin(), queue.end(), [&](const Pending& p) { return canStart(p); });
+                return it != queue.end() || stopping;
+            });
+            if (it == queue.end()) return; // stopping, with nothing left to run
+
+            auto p = std::move(*it);
+            queue.erase(it);
+            for (const auto& d : p.devices) ++busy[d];
+            lock.unlock();
+
+            // The session runs jobs side by side already, so each one scans on a single thread.
+            const JoinResources res{1, &pools[p.job.options.huge_pages]};
+            JoinResult ret = JoinResult::InternalError;
+            try {
+                std::vector<const char*> inputs;
+                for (const auto& f : p.job.input_files) inputs.push_back(f.c_str());
+                ret = join_files(int(inputs.size()), inputs.data(), p.job.output_file.c_str(), p.job.options, p.job.prog_cb, res);
+            } catch (const std::bad_alloc&) {}
+            if (p.done_cb) {
+                try {
+                    p.done_cb(p.job, ret);
+                } catch (...) {}
+            }
+
+            lock.lock();
+            for (const auto& d : p.devices) --busy[d];
+            --unfinished;
+            cv.notify_all();
+        }
+    }
+};
+
+JoinSession::JoinSession(const SessionOptions& options) noexcept
+    : impl(new (std::nothrow) Impl)
+{
+    if (!impl) return;
+    impl->options = options;
+    if (impl->options.max_jobs == 0) impl->options.max_jobs = std::max(1u, std::thread::hardware_concurrency());
+    if (impl->options.max_jobs_per_device == 0) impl->options.max_jobs_per_device = 1;
+}
+
+JoinSession::~JoinSession() noexcept
+{
+    if (!impl) return;
+    wait();
+    {
+        std::lock_guard lock(impl->m);
+        impl->stopping = true;
+        impl->cv.notify_all();
+    }
+    for (auto& t : impl->workers) t.join();
+}
+
+bool JoinSession::submit(JoinJob job, JoinDoneCb done_cb) noexcept
+{
+    if (!impl) return false;
+    try {
+        Impl::Pending p{std::move(job), std::move(done_cb), {}};
+        p.devices.push_back(device_of(p.job.output_file));
+        for (const auto& f : p.job.input_files) p.devices.push_back(device_of(f));
+        std::sort(p.devices.begin(), p.devices.end());
+        p.devices.erase(std::unique(p.devices.begin(), p.devices.end()), p.devices.end());
+
+        std::lock_guard lock(impl->m);
+        // Workers are only started as jobs come in, and then stay until the session ends.
+        if (impl->workers.size() < impl->options.max_jobs && impl->workers.size() <= impl->unfinished) {
+            try {
+                impl->workers.emplace_back([this] { impl->work(); });
+            } catch (const std::system_error&) {
+                if (impl->workers.empty()) return false;
+            }
+        }
+        impl->queue.push_back(std::move(p));
+        ++impl->unfinished;
+        impl->cv.notify_all();
+    } catch (const std::bad_alloc&) {
+        return false;
+    }
+    return true;
+}
+
+void JoinSession::wait() noexcept
+{
+    if (!impl) return;
+    std::unique_lock lock(impl->m);
+    impl->cv.wait(lock, [&] { return impl->unfinished == 0; });
+}
@@ -1,5 +1,6 @@
 #include "mp4.hpp"
 #include "fourcc.hpp"
+#include "io_stats.hpp"
 
 namespace mp4join {
 
@@ -22,7 +23,90 @@ public:
 
 bool Mp4Stream::open(const std::string & filename) noexcept
 {
-    return BinaryFileStream::open(filename, OpenMode::READ);
+    src = nullptr;
+    return fs.open(filename, BinaryFileStream::OpenMode::READ_MMAP);
+}
+
+bool Mp4Stream::open(InputStream & source) noexcept
+{
+    fs.close();
+    src = &source;
+    return src->seek(0);
+}
+
+bool Mp4Stream::close() noexcept
+{
+    if (!src) return fs.close();
+    src = nullptr;
+    return true;
+}
+
+Mp4Stream::OffsetType Mp4Stream::getLength() const noexcept
+{
+    return src ? src->size() : fs.getLength();
+}
+
+const unsigned char* Mp4Stream::view(OffsetType offset, std::size_t n) const noexcept
+{
+    if (!src) return fs.view(offset, n);
+
+    const auto p = src->data();
+    if (!p || offset < 0 || offset > src->size() || OffsetType(n) > src->size() - offset) return nullptr;
+    return p + offset;
+}
+
+void Mp4Stream::setIoStats(IoStats* s) noexcept
+{
+    stats = s;
+    fs.setIoStats(s);
+}
+
+void Mp4Stream::adviseSequential(OffsetType offset, OffsetType n) noexcept
+{
+    if (!src) fs.adviseSequential(offset, n);
+}
+
+void Mp4Stream::dropCache(OffsetType offset, OffsetType n) noexcept
+{
+    if (!src) fs.dropCache(offset, n);
+}
+
+bool Mp4Stream::isOpen() const noexcept
+{
+    return src || fs.isOpen();
+}
+
+bool Mp4Stream::read(void* buf, std::size_t n) noexcept
+{
+    if (!src) return fs.read(buf, n);
+
+    const auto start = stats ? IoStats::Clock::now() : IoStats::Clock::time_point{};
+    if (!src->read(buf, n)) return false;
+    if (stats) stats->read(n, start);
+    return true;
+}
+
+bool Mp4Stream::write(const void*, std::size_t) noexcept
+{
+    return false; // read only
+}
+
+bool Mp4Stream::seek(OffsetType offset, SeekFrom from) noexcept
+{
+    if (!src) return fs.seek(offset, from);
+
+    switch (from) {
+    case SeekFrom::Current: offset += src->tell(); break;
+    case SeekFrom::End:     offset += src->size(); break;
+    default: break;
+    }
+    if (stats) stats->seek();
+    return src->seek(offset);
+}
+
+Mp4Stream::OffsetType Mp4Stream::tell() const noexcept
+{
+    return src ? src->tell() : fs.tell();
 }
 
 
@@ -113,6 +197,55 @@ std::vector<unsigned char> Mp4Stream::readAtomData(const AtomInfo & atom)
 }
 
 
+std::vector<Mp4Stream::Box> Mp4Stream::parseChildren(const AtomInfo& container, bool (*descend)(uint32_t))
+{
+    std::vector<Box> boxes;
+    for (auto pos = container.dataOffset(); pos < container.endOffset(); ) {
+        if(!seek(OffsetType(pos))) throw io_error("Could not seek to child atom.");
+        auto& box = boxes.emplace_back();
+        box.atom = parseAtom();
+        if(box.atom.endOffset() > container.endOffset()) throw parse_error("Atom goes beyond its container.");
+        if(descend(box.atom.fourcc)) box.children = parseChildren(box.atom, descend);
+        pos = box.atom.endOffset();
+    }
+    return boxes;
+}
+
+
+bool Mp4Stream::buildIndex(bool (*descend)(uint32_t)) noexcept
+{
+    root.clear();
+    has_index = false;
+    try {
+        seek(0);
+        for (auto& atom : getAllAtom(getLength())) {
+            root.push_back({atom, descend(atom.fourcc) ? parseChildren(atom, descend) : std::vector<Box>{}});
+        }
+    }
+    catch (const std::exception&) { // error, or bad_alloc
+        root.clear();
+        return false;
+    }
+    has_index = true;
+    return true;
+}
+
+
+const unsigned char* Mp4Stream::readBlockEx(std::size_t n, std::vector<unsigned char>& buf)
+{
+    const auto pos = tell();
+    if (const auto p = view(pos, n)) {
+        if(!seek(pos + OffsetType(n))) throw io_error("Could not seek past block.");
+        if(stats) stats->mappedRead(n);
+        return p;
+    }
+
+    buf.resize(n);
+    if(!read(buf.data(), n)) throw io_error("Failure reading block.");
+    return buf.data();
+}
+
+
 bool mp4join::Mp4Stream::verify() noexcept
 {
     seek(0);
@@ -2,6 +2,7 @@
 #define MP4_HPP_E4F672AA_32D1_47F4_8A80_1BD0416A2267
 
 #include "binary_file_stream.hpp"
+#include "mp4join/io.hpp"
 #include <stdexcept>
 #include <vector>
 
@@ -22,11 +23,35 @@ public:
 
 // Binary stream for MP4 file.
 // This class is mainly for mp4join.
-class Mp4Stream : public BinaryFileStream {
+// It reads either a file of its own, or a user-supplied InputStream.
+class Mp4Stream : public BinaryStream {
 public:
-    using BinaryFileStream::BinaryFileStream;
-
+    // Opens for reading, memory mapped where the platform allows it.
     bool open(const std::string& filename) noexcept;
+    // Reads from `source`, which must outlive this stream.
+    bool open(InputStream& source) noexcept;
+    bool close() noexcept;
+
+    // The file behind this stream, for kernel copies. nullptr for an InputStream.
+    BinaryFileStream* file() noexcept { return src ? nullptr : &fs; }
+
+    OffsetType getLength() const noexcept;
+
+    // Direct pointer to n bytes at offset, if the input is in memory (see BinaryFileStream::view()).
+    const unsigned char* view(OffsetType offset, std::size_t n) const noexcept;
+
+    // Count the I/O calls on the input in `stats` from now on; nullptr to stop.
+    void setIoStats(IoStats* stats) noexcept;
+
+    // Page cache hints, passed on to the file. No-ops for an InputStream.
+    void adviseSequential(OffsetType offset, OffsetType n) noexcept;
+    void dropCache(OffsetType offset, OffsetType n) noexcept;
+
+    virtual bool isOpen() const noexcept override;
+    virtual bool read(void* buf, std::size_t n) noexcept override;
+    virtual bool write(const void* buf, std::size_t n) noexcept override;
+    virtual bool seek(OffsetType offset, SeekFrom from = SeekFrom::Begin) noexcept override;
+    virtual OffsetType tell() const noexcept override;
 
     // This holds stream-specific info for an atom.
     struct AtomInfo {
@@ -40,6 +65,12 @@ public:
         uint64_t endOffset()  const { return offset + size; }
     };
 
+    // A box of the index, with its children if it's one of the containers the index descends into.
+    struct Box {
+        AtomInfo atom;
+        std::vector<Box> children;
+    };
+
 
     template <Endian endian=Endian::BE, typename IntT, unsigned BytesToRead = sizeof(IntT)>
     void readNumEx(IntT& dest) {
@@ -75,6 +106,26 @@ public:
 
     std::vector<unsigned char> readAtomData(const AtomInfo& atom);
 
+    // Parse the box structure of the whole input in a single pass, descending into the containers `descend` accepts,
+    // so that later phases can walk it without parsing again. Root boxes are taken up to the first one that doesn't parse,
+    // like getAllAtom() does. Inside a container, anything that doesn't parse fails the whole index.
+    bool buildIndex(bool (*descend)(uint32_t fourcc)) noexcept;
+    bool indexed() const noexcept { return has_index; }
+    // The root boxes, as parsed by buildIndex().
+    const std::vector<Box>& index() const noexcept { return root; }
+
+    // Get n bytes at the current position and advance past them.
+    // Points straight into the memory mapping if there is one, otherwise into `buf`.
+    const unsigned char* readBlockEx(std::size_t n, std::vector<unsigned char>& buf);
+
+private:
+    std::vector<Box> parseChildren(const AtomInfo& container, bool (*descend)(uint32_t));
+
+    BinaryFileStream fs;
+    InputStream* src = nullptr;
+    IoStats* stats = nullptr;
+    std::vector<Box> root;
+    bool has_index = false;
 };
 
 }
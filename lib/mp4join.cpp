@@ -1,9 +1,25 @@
 #include "mp4join/mp4join.hpp"
+#include "join_resources.hpp"
 #include "mp4.hpp"
+#include "binary_memory_stream.hpp"
+#include "copy_pipeline.hpp"
+#include "uring_copy.hpp"
 #include "fourcc.hpp"
+#include "byte_order.hpp"
+#include "sample_tables.hpp"
+#include "crc32c.hpp"
+#include <algorithm>
 #include <array>
 #include <vector>
+#include <string>
+#include <cstring>
+#include <cctype>
+#include <filesystem>
+#include <limits>
 #include <optional>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 using std::uint8_t, std::uint32_t, std::uint64_t, std::int64_t;
 
@@ -27,31 +43,22 @@ should_descend(uint32_t type)
 }
 
 // Similar to Mp4Stream::verify(), with additional checks.
+// Indexes the input on the way, for all later phases to use.
 bool
 check_input(Mp4Stream& file) noexcept {
-    file.seek(0);
+    if (!file.indexed() && !file.buildIndex(should_descend)) return false;
     bool has_moov = false, has_mdat = false;
     bool err = false;
-    try {
-        const auto root_atoms = file.getAllAtom(file.getLength());
-        for (const auto& a : root_atoms) {
-            if (a.fourcc == fourcc("moov")) {
-                if (has_moov) {
-                    err = true;
-                    break;
-                }
-                has_moov = true;
-            }
-            if (a.fourcc == fourcc("mdat")) {
-                if (has_mdat) {
-                    err = true;  // We don't handle mutiple mdat, although it is allowed by ISOBMFF.
-                    break;
-                }
-                has_mdat = true;
+    for (const auto& box : file.index()) {
+        const auto& a = box.atom;
+        if (a.fourcc == fourcc("moov")) {
+            if (has_moov) {
+                err = true;
+                break;
             }
+            has_moov = true;
         }
-    } catch(const error&) {
-        err = true;
+        if (a.fourcc == fourcc("mdat")) has_mdat = true; // possibly several, see MdatRange
     }
 
     const bool rtv = has_mdat && has_moov && !err;
@@ -62,54 +69,228 @@ check_input(Mp4Stream& file) noexcept {
 
 // structs to hold merge context info.
 
+// Where the large tables of a track (stsz, stco/co64, stss, sdtp) are in one input, for merges that
+// stream them into the output instead of holding them in memory (JoinOptions::table_memory_limit).
+struct TableSource {
+    std::size_t file;       // Input index
+    int64_t stsz_pos;       // Start of the stsz entries
+    uint32_t sample_size;   // Size shared by all samples, 0 if they differ
+    uint32_t sample_count;
+    int64_t stco_pos;       // Start of the stco/co64 entries
+    bool co64;
+    uint32_t chunk_count;
+    uint64_t chunk_max;     // Largest chunk offset, as found in the input
+    int64_t chunk_adjust;   // Added to the rebased chunk offsets (see rebase_offset()), to make them relative to the merged mdat data like in ChunkOffsets
+    bool external;          // Reference movie: chunk offsets stay as found in the input, chunk_adjust is unused
+    int64_t stss_pos;
+    uint32_t sync_count;
+    uint32_t sample_offset; // Added to the sync sample numbers
+    int64_t sdtp_pos;
+    uint64_t sdtp_size;
+};
+
 struct TrackInfo {
+    uint32_t track_id;                                 // From tkhd
+    uint32_t timescale;                                // From mdhd
     uint64_t tkhd_duration;
     uint64_t elst_segment_duration;
+    int64_t elst_media_time;                           // Of the first edit that isn't empty, 0 without edit list
     uint64_t mdhd_duration;
-    std::vector<std::array<uint32_t, 2>> stts;  // Time-to-sample box: sample count, sample duration
-    std::vector<uint32_t> stsz;                        // Sample size table in stsz
-    std::vector<uint64_t> stco;                        // Chunk offset table (64bit)
+    std::vector<std::array<uint32_t, 2>> stts;  // Time-to-sample box: sample count, sample duration. Run-length, see compact_stts().
+    std::vector<std::array<uint32_t, 2>> ctts;  // Composition offsets: sample count, offset (as int32). Run-length too. Empty if all 0.
+    SampleSizes stsz;                                  // Sample sizes in stsz
+    ChunkOffsets stco;                                 // Chunk offset table
     std::vector<uint32_t> stss;                        // Sync sample table
     std::vector<uint8_t> sdtp;                         // Sample dependency flags table
-    std::vector<std::array<uint32_t, 3>> stsc; // Sample-to-chunk table: first_chunk, samples_per_chunk, sample_description_id
-    uint32_t sample_offset;
-    uint32_t chunk_offset;
-    uint32_t stsz_sample_size;
-    uint32_t stsz_count;
-    uint64_t co64_final_position;                      // Chunk offset table starting offset in output file.
+    std::vector<std::array<uint32_t, 3>> stsc; // Sample-to-chunk table: first_chunk, samples_per_chunk, sample_description_id. Run-length.
+    std::vector<unsigned char> stsd;                   // Raw sample description entries. Only merged for reference movies.
+    uint32_t stsd_count;                               // Number of entries in stsd
+    uint64_t co64_final_position;                      // Chunk offset table starting offset within the serialized moov.
+    std::vector<TableSource> sources;                  // Streamed merge only, one per input. stsz, stco, stss and sdtp stay empty then.
     bool skip;                                         // Flag for do-not-merge track, e.g. timecode track.
 };
+
+// Payload of one mdat box of an input. An input may have several, their payloads are joined back to back,
+// in file order, into its media data. The media data of all inputs then goes, in order, into the merged mdat.
+struct MdatRange {
+    uint64_t offset;   // within the input file
+    uint64_t size;
+    uint64_t position; // within the media data of the input, i.e. the size of the ranges before
+};
+
+// A table left out of the serialized moov, to be streamed in at `position` while moov is written; see write_moov().
+struct StreamedTable {
+    uint64_t position;      // within the serialized moov
+    std::size_t track_id;
+    uint32_t fourcc;
+};
+// Each input is first scanned into a MergeInfo of its own, with sample numbers, chunk numbers
+// and chunk offsets relative to that input (chunk offsets relative to its mdat data).
+// stitch() then appends these, in order, to the merged MergeInfo.
 struct MergeInfo {
     uint64_t mvhd_duration;
     std::vector<TrackInfo> trak_infos;
-    uint64_t mdat_offset;                          // current file's offset in merged mdat data
-    std::vector<std::array<uint64_t, 2>> mdat_position; // dataOffset & dataSize of mdat in each file
-    uint64_t mdat_final_position;                  // mdat data offset in output file. Used to adjust co64.
+    uint64_t mdat_offset;                          // size of the merged mdat data so far
+    std::vector<std::vector<MdatRange>> mdat_ranges; // mdat payloads of each file, never empty
+    uint64_t mdat_final_position;                  // mdat data offset in output file, from plan_layout(). Used to adjust co64.
+    std::vector<std::string> data_refs;            // Reference movie only: URL of each input, where the media data stays.
+    bool co64;                                     // Chunk offsets need 64 bits in the output, from plan_layout().
+    bool streamed;                                 // Large tables are streamed from the inputs; see TableSource.
+    std::vector<StreamedTable> streamed_tables;    // Streamed merge only, from plan_layout().
 };
 
+// Size of the media data of an input, all its mdat payloads together.
+uint64_t
+media_size(const std::vector<MdatRange>& ranges)
+{
+    return ranges.empty() ? 0 : ranges.back().position + ranges.back().size;
+}
+
+// Make chunk offset `offset` of an input relative to its media data.
+// An offset outside of all ranges is taken as part of the range before it, or of the first one.
+uint64_t
+rebase_offset(const std::vector<MdatRange>& ranges, uint64_t offset)
+{
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), offset, [](uint64_t o, const MdatRange& r) { return o < r.offset; });
+    if (it != ranges.begin()) --it;
+    return it->position + (offset - it->offset);
+}
+
+// The reverse of rebase_offset(): where `position` within the media data of an input is in the input file.
+uint64_t
+file_offset(const std::vector<MdatRange>& ranges, uint64_t position)
+{
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), position, [](uint64_t p, const MdatRange& r) { return p < r.position; });
+    if (it != ranges.begin()) --it;
+    return it->offset + (position - it->position);
+}
+
+// Merged chunk offset of entry `offset` of a streamed table from `s`.
+uint64_t
+merged_chunk_offset(const MergeInfo& info, const TableSource& s, uint64_t offset)
+{
+    return s.external ? offset : rebase_offset(info.mdat_ranges.at(s.file), offset) + s.chunk_adjust;
+}
+
+// Merged table sizes of a track, whether its tables are held in memory or streamed.
+
+uint32_t
+sample_count(const TrackInfo& t)
+{
+    uint32_t n = t.stsz.count();
+    for (const auto& s : t.sources) n += s.sample_count;
+    return n;
+}
+
+uint32_t
+chunk_count(const TrackInfo& t)
+{
+    auto n = uint32_t(t.stco.size());
+    for (const auto& s : t.sources) n += s.chunk_count;
+    return n;
+}
+
+// Largest chunk offset, relative to the merged mdat data.
+uint64_t
+max_chunk_offset(const MergeInfo& info, const TrackInfo& t)
+{
+    auto m = t.stco.max();
+    for (const auto& s : t.sources) {
+        if (s.chunk_count) m = std::max(m, merged_chunk_offset(info, s, s.chunk_max));
+    }
+    return m;
+}
+
+// Size shared by all samples, or 0 if they differ.
+uint32_t
+constant_sample_size(const TrackInfo& t)
+{
+    if (t.sources.empty()) return t.stsz.constantSize();
+    uint32_t size = 0;
+    for (const auto& s : t.sources) {
+        if (s.sample_count == 0) continue;
+        if (s.sample_size == 0 || (size && s.sample_size != size)) return 0;
+        size = s.sample_size;
+    }
+    return size;
+}
+
+// Size of the entries of a merged table in the output, i.e. without box header and counts.
+uint64_t
+entries_size(const TrackInfo& t, uint32_t type, bool co64)
+{
+    uint64_t n = 0;
+    switch (type) {
+    case fourcc("stts"): return 8 * uint64_t(t.stts.size());
+    case fourcc("ctts"): return 8 * uint64_t(t.ctts.size());
+    case fourcc("stsc"): return 12 * uint64_t(t.stsc.size());
+    case fourcc("stsz"): return constant_sample_size(t) ? 0 : 4 * uint64_t(sample_count(t));
+    case fourcc("stco"):
+    case fourcc("co64"): return (co64 ? 8 : 4) * uint64_t(chunk_count(t));
+    case fourcc("stss"):
+        n = t.stss.size();
+        for (const auto& s : t.sources) n += s.sync_count;
+        return 4 * n;
+    case fourcc("sdtp"):
+        n = t.sdtp.size();
+        for (const auto& s : t.sources) n += s.sdtp_size;
+        return n;
+    default: return 0;
+    }
+}
+
+// Call fn(entries, n) for the `count` table entries of `entry_size` bytes each at `pos` in `file`, a block at a time,
+// so that huge tables never have to be in memory at once. Stops early if `fn` returns false.
+constexpr uint64_t table_block_entries = 16384;
+
+template <typename Fn>
+bool
+for_each_block(Mp4Stream& file, int64_t pos, uint64_t count, std::size_t entry_size, std::vector<unsigned char>& buf, Fn fn)
+{
+    file.seek(pos);
+    for (uint64_t done = 0; done < count; ) {
+        const auto n = std::size_t(std::min(count - done, table_block_entries));
+        if (!fn(file.readBlockEx(n * entry_size, buf), n)) return false;
+        done += n;
+    }
+    return true;
+}
+
+// Decode `count` fixed-size entries of a sample table in one go, appending them to `dest`.
+// `decode` turns the raw big-endian bytes of one entry into a table element.
+// Kept as a plain indexed loop over pre-sized storage, so the compiler can vectorize it.
+template <std::size_t EntrySize, typename T, typename Decode>
+void
+append_table(std::vector<T>& dest, const unsigned char* src, uint32_t count, Decode decode)
+{
+    const auto base = dest.size();
+    dest.resize(base + count);
+    T* const out = dest.data() + base;
+    for (uint32_t i = 0; i < count; ++i) {
+        out[i] = decode(src + std::size_t(i) * EntrySize);
+    }
+}
+
+// Scan `boxes`, from the index of a single input, into its own `info`.
+// `info.mdat_ranges` must already hold the input's mdat payloads.
 bool
-merge_info(MergeInfo& info, Mp4Stream& file, std::size_t file_id, std::size_t current_track_id, int64_t max_read) // bool in_trak?
+merge_info(MergeInfo& info, Mp4Stream& file, const std::vector<Mp4Stream::Box>& boxes, std::size_t current_track_id)
 {
-    const auto start_pos = file.tell();
-    if (start_pos < 0 || start_pos >= file.getLength()) return false;
+    std::vector<unsigned char> table_buf; // backing storage for sample tables, if the file isn't memory mapped
 
-    for(;;)
+    for (const auto& box : boxes)
     {
-        const auto atom = file.parseAtom();
+        const auto& atom = box.atom;
         if (should_descend(atom.fourcc)) {
             if (atom.fourcc == fourcc("trak") && current_track_id>=info.trak_infos.size()) {
-                if (file_id == 0) { // should make room
-                    info.trak_infos.resize(current_track_id+1);
-                }
-                else { // following videos aren't expected to contain additional tracks.
-                    return false;
-                }
+                info.trak_infos.resize(current_track_id+1);
             }
-            if (!merge_info(info, file, file_id, current_track_id, atom.dataSize())) return false;
+            if (!merge_info(info, file, box.children, current_track_id)) return false;
             if (atom.fourcc == fourcc("trak")) current_track_id += 1;
 
         }
         else { // "leaf" atoms that contain actual data
+            file.seek(atom.dataOffset());
             if (eq_one(atom.fourcc, fourcc("mvhd"), fourcc("tkhd"), fourcc("mdhd"))) {
                 uint8_t ver; uint32_t _flag;
                 file.readNumEx(ver);
@@ -136,11 +317,13 @@ merge_info(MergeInfo& info, Mp4Stream& file, std::size_t file_id, std::size_t cu
                         track_info.tkhd_duration += [&]() -> uint64_t {
                             if(ver==1) {
                                 uint64_t duration;
-                                file.seek(8+8+4+4, From::Current); file.readNumEx(duration);
+                                file.seek(8+8, From::Current); file.readNumEx(track_info.track_id);
+                                file.seek(4, From::Current); file.readNumEx(duration);
                                 return duration;
                             } else {
                                 uint32_t duration;
-                                file.seek(4+4+4+4, From::Current); file.readNumEx(duration);
+                                file.seek(4+4, From::Current); file.readNumEx(track_info.track_id);
+                                file.seek(4, From::Current); file.readNumEx(duration);
                                 return duration;
                             }
                         }();
@@ -149,11 +332,11 @@ merge_info(MergeInfo& info, Mp4Stream& file, std::size_t file_id, std::size_t cu
                         track_info.mdhd_duration += [&]() -> uint64_t {
                             if(ver==1) {
                                 uint64_t duration;
-                                file.seek(8+8+4, From::Current); file.readNumEx(duration);
+                                file.seek(8+8, From::Current); file.readNumEx(track_info.timescale); file.readNumEx(duration);
                                 return duration;
                             } else {
                                 uint32_t duration;
-                                file.seek(4+4+4, From::Current); file.readNumEx(duration);
+                                file.seek(4+4, From::Current); file.readNumEx(track_info.timescale); file.readNumEx(duration);
                                 return duration;
                             }
                         }();
@@ -161,80 +344,153 @@ merge_info(MergeInfo& info, Mp4Stream& file, std::size_t file_id, std::size_t cu
                 }
             } //
 
-            if (eq_one(atom.fourcc, fourcc("elst"), fourcc("stts"), fourcc("stsz"), fourcc("stss"), fourcc("stco"), fourcc("co64"), fourcc("sdtp"), fourcc("stsc")))
+            if (eq_one(atom.fourcc, fourcc("elst"), fourcc("stts"), fourcc("ctts"), fourcc("stsz"), fourcc("stss"), fourcc("stco"), fourcc("co64"), fourcc("sdtp"), fourcc("stsc")))
             {
                 if(current_track_id>=info.trak_infos.size()) return false; // should not happen inside trak
                 auto& track_info = info.trak_infos[current_track_id];
+                if(info.streamed && track_info.sources.empty()) track_info.sources.emplace_back();
 
-                if(!(track_info.skip && file_id > 0)) {
+                {
                     uint8_t ver; uint32_t _flag;
                     file.readNumEx(ver);
                     file.readNumEx<Endian::BE, uint32_t, 3>(_flag);
                     if(ver>1) return false;  // Version is either 0 or 1.
 
                     if(atom.fourcc == fourcc("elst")) {
-                        file.seek(4, From::Current);
-                        track_info.elst_segment_duration += [&]() -> uint64_t {
+                        // Only the first entry's duration grows in the output. The media time is what stitch()
+                        // lines up the composition offsets of the other inputs with.
+                        if(atom.dataSize() < 8) return false;
+                        uint32_t count; file.readNumEx(count);
+                        if(count > (atom.dataSize() - 8) / (ver == 1 ? 20 : 12)) return false; // table doesn't fit in its box
+                        for(uint32_t i = 0; i < count; ++i) {
+                            uint64_t duration;
+                            int64_t media_time;
                             if(ver==1) {
-                                uint64_t duration; file.readNumEx(duration);
-                                return duration;
+                                uint64_t t; file.readNumEx(duration); file.readNumEx(t);
+                                media_time = int64_t(t);
                             } else {
-                                uint32_t duration; file.readNumEx(duration);
-                                return duration;
+                                uint32_t d, t; file.readNumEx(d); file.readNumEx(t);
+                                duration = d;
+                                media_time = int32_t(t);
                             }
-                        }();
+                            file.seek(4, From::Current); // media_rate
+                            if(i == 0) track_info.elst_segment_duration += duration;
+                            if(media_time != -1) { // not an empty edit
+                                track_info.elst_media_time = media_time;
+                                break;
+                            }
+                        }
                     }
                     if(atom.fourcc == fourcc("stsz")) { // `stz2' is not supported
-                        // The sample size field from all files are assumed to be identical,
-                        // i.e. either all 0 or some positive value.
-                        file.readNumEx(track_info.stsz_sample_size);
+                        if(atom.dataSize() < 12) return false;
+                        uint32_t sample_size; file.readNumEx(sample_size);
                         uint32_t count; file.readNumEx(count);
-                        if(track_info.stsz_sample_size == 0) {
-                            for(uint32_t i=0; i<count; ++i) {
-                                uint32_t size; file.readNumEx(size);
-                                track_info.stsz.push_back(size);
+                        if(sample_size == 0 && count > (atom.dataSize() - 12) / 4) return false; // table doesn't fit in its box
+                        if(info.streamed) {
+                            // Only find out whether all samples have the same size, like SampleSizes does.
+                            auto& src = track_info.sources.front();
+                            src.stsz_pos = file.tell();
+                            src.sample_count = count;
+                            src.sample_size = sample_size;
+                            if(sample_size == 0 && count) {
+                                const auto first = loadBE<uint32_t>(file.readBlockEx(4, table_buf));
+                                bool same = true;
+                                for_each_block(file, src.stsz_pos, count, 4, table_buf, [&](const unsigned char* p, std::size_t n) {
+                                    for (std::size_t i = 0; i < n; ++i) same = same && loadBE<uint32_t>(p + i * 4) == first;
+                                    return same;
+                                });
+                                if(same) src.sample_size = first;
                             }
                         }
-                        track_info.stsz_count += count;
+                        else if(sample_size == 0) {
+                            const auto p = file.readBlockEx(std::size_t(count) * 4, table_buf);
+                            track_info.stsz.appendTable(p, count); // stays constant if all sizes are the same
+                        }
+                        else {
+                            track_info.stsz.appendConstant(sample_size, count);
+                        }
                     }
                     if(atom.fourcc == fourcc("sdtp")) {
-                        for(uint64_t i=0; i<atom.dataSize()-4; ++i) {
-                            uint8_t data; file.readNumEx(data);
-                            track_info.sdtp.push_back(data);
+                        if(atom.dataSize() < 4) return false;
+                        const auto n = std::size_t(atom.dataSize() - 4);
+                        if(info.streamed) {
+                            track_info.sources.front().sdtp_pos = file.tell();
+                            track_info.sources.front().sdtp_size = n;
+                        }
+                        else {
+                            const auto p = file.readBlockEx(n, table_buf);
+                            track_info.sdtp.insert(track_info.sdtp.end(), p, p + n);
                         }
                     }
-                    if (eq_one(atom.fourcc, fourcc("stss"), fourcc("stco"), fourcc("co64"), fourcc("stts"), fourcc("stsc"))) {
+                    if (eq_one(atom.fourcc, fourcc("stss"), fourcc("stco"), fourcc("co64"), fourcc("stts"), fourcc("ctts"), fourcc("stsc"))) {
+                        if(atom.dataSize() < 8) return false;
                         uint32_t count; file.readNumEx(count);
-                        const auto current_file_mdat_offset = info.mdat_position.at(file_id)[0];
-                        // The cast is only for clarity.
-                        // ISO C++ guarantees correct final result, even no cast applied here.
-                        const auto mdat_adjust = -int64_t(current_file_mdat_offset) + int64_t(info.mdat_offset);
-                        while(count-- > 0) {
+                        const std::size_t entry_size = eq_one(atom.fourcc, fourcc("stss"), fourcc("stco")) ? 4
+                                                     : eq_one(atom.fourcc, fourcc("co64"), fourcc("stts"), fourcc("ctts")) ? 8 : 12;
+                        if(count > (atom.dataSize() - 8) / entry_size) return false; // table doesn't fit in its box
+
+                        const auto& mdat_ranges = info.mdat_ranges.at(0);
+
+                        if(info.streamed && atom.fourcc == fourcc("stss")) {
+                            track_info.sources.front().stss_pos = file.tell();
+                            track_info.sources.front().sync_count = count;
+                        }
+                        else if(info.streamed && eq_one(atom.fourcc, fourcc("stco"), fourcc("co64"))) {
+                            // Only the largest offset is needed, to pick stco or co64 for the output.
+                            auto& src = track_info.sources.front();
+                            src.stco_pos = file.tell();
+                            src.co64 = atom.fourcc == fourcc("co64");
+                            src.chunk_count = count;
+                            for_each_block(file, src.stco_pos, count, entry_size, table_buf, [&](const unsigned char* p, std::size_t n) {
+                                for (std::size_t i = 0; i < n; ++i) {
+                                    src.chunk_max = std::max(src.chunk_max, src.co64 ? loadBE<uint64_t>(p + i * 8) : loadBE<uint32_t>(p + i * 4));
+                                }
+                                return true;
+                            });
+                        }
+                        else {
+                            const auto p = file.readBlockEx(count * entry_size, table_buf);
+
                             if(atom.fourcc == fourcc("stss")) {
-                                uint32_t sample_id; file.readNumEx(sample_id);
-                                track_info.stss.push_back(sample_id + track_info.sample_offset);
+                                append_table<4>(track_info.stss, p, count, [](const unsigned char* e) {
+                                    return loadBE<uint32_t>(e);
+                                });
                             }
                             if(atom.fourcc == fourcc("stco")) {
-                                uint32_t chunk_offset; file.readNumEx(chunk_offset);
-                                track_info.stco.push_back(chunk_offset + mdat_adjust);
+                                for (uint32_t i = 0; i < count; ++i) {
+                                    track_info.stco.push_back(rebase_offset(mdat_ranges, loadBE<uint32_t>(p + std::size_t(i) * 4)));
+                                }
                             }
                             if(atom.fourcc == fourcc("co64")) {
-                                uint64_t chunk_offset; file.readNumEx(chunk_offset);
-                                track_info.stco.push_back(int64_t(chunk_offset) + mdat_adjust); // Again, for clarity only.
+                                for (uint32_t i = 0; i < count; ++i) {
+                                    track_info.stco.push_back(rebase_offset(mdat_ranges, loadBE<uint64_t>(p + std::size_t(i) * 8)));
+                                }
                             }
                             if(atom.fourcc == fourcc("stts")) {
-                                uint32_t consecutive_samples; file.readNumEx(consecutive_samples);
-                                uint32_t sample_duration; file.readNumEx(sample_duration);
-                                track_info.stts.push_back({consecutive_samples, sample_duration});
+                                // consecutive samples, sample duration
+                                const auto base = track_info.stts.size();
+                                append_table<8>(track_info.stts, p, count, [](const unsigned char* e) {
+                                    return std::array<uint32_t, 2>{loadBE<uint32_t>(e), loadBE<uint32_t>(e + 4)};
+                                });
+                                compact_stts(track_info.stts, base);
+                            }
+                            if(atom.fourcc == fourcc("ctts")) {
+                                // sample count, composition offset: unsigned in version 0, signed in version 1
+                                const auto base = track_info.ctts.size();
+                                append_table<8>(track_info.ctts, p, count, [](const unsigned char* e) {
+                                    return std::array<uint32_t, 2>{loadBE<uint32_t>(e), loadBE<uint32_t>(e + 4)};
+                                });
+                                if(ver==0 && std::any_of(track_info.ctts.begin() + base, track_info.ctts.end(),
+                                                         [](const auto& x) { return x[1] > uint32_t(INT32_MAX); })) return false;
+                                compact_stts(track_info.ctts, base);
                             }
                             if(atom.fourcc == fourcc("stsc")) {
-                                uint32_t first_chunk, samples_per_chunk, sample_desc_id;
-                                file.readNumEx(first_chunk); file.readNumEx(samples_per_chunk); file.readNumEx(sample_desc_id);
-                                track_info.stsc.push_back({
-                                    first_chunk + track_info.chunk_offset,
-                                    samples_per_chunk,
-                                    sample_desc_id
+                                // first chunk, samples per chunk, sample description id
+                                const auto base = track_info.stsc.size();
+                                append_table<12>(track_info.stsc, p, count, [](const unsigned char* e) {
+                                    return std::array<uint32_t, 3>{loadBE<uint32_t>(e), loadBE<uint32_t>(e + 4), loadBE<uint32_t>(e + 8)};
                                 });
+                                compact_stsc(track_info.stsc, base);
                             }
                         }
                     }
@@ -247,61 +503,478 @@ merge_info(MergeInfo& info, Mp4Stream& file, std::size_t file_id, std::size_t cu
              * 3. GoPro seems to have a minf->gmhd->tmcd box in the tmcd track
              * Additionally, other tracks might reference the tmcd track, in `tref' box.
              */
-            if (atom.fourcc == fourcc("stsd")) {
-                file.seek(4+4+4, From::Current);
-                uint32_t format = 0; file.readNum(format);
-                if (format == fourcc("tmcd") && current_track_id < info.trak_infos.size()) { // we're inside a tmcd trak
-                    info.trak_infos.at(current_track_id).skip = true;
+            if (atom.fourcc == fourcc("stsd") && current_track_id < info.trak_infos.size()) {
+                auto& track_info = info.trak_infos[current_track_id];
+                if(atom.dataSize() < 8) return false;
+                file.seek(4, From::Current);
+                file.readNumEx(track_info.stsd_count);
+                const auto n = std::size_t(atom.dataSize() - 8);
+                const auto p = file.readBlockEx(n, table_buf);
+                track_info.stsd.assign(p, p + n);
+                if (n >= 8 && loadBE<uint32_t>(p + 4) == fourcc("tmcd")) { // we're inside a tmcd trak
+                    track_info.skip = true;
                 }
             }
-            // Seek to atom end
-            file.seek(atom.endOffset());
         }
-        // End of file not checked, so max_read should not go beyond EOF.
-        if (file.tell() - start_pos >= max_read) break;
     }
 
     return true;
 }
 
-bool copyWithJoinProg(BinaryStreamBase& dst, BinaryStreamBase& src, std::size_t n, std::size_t bufsize, const JoinProgCb& cb, int prog_start, int prog_end) noexcept { // assumes cb is not empty
-    const auto buf = std::make_unique<unsigned char[]>(bufsize);
-    int prog = prog_start;
-    std::size_t cnt = 0;
-    while (cnt < n) {
-        const auto sz = n - cnt > bufsize ? bufsize : n - cnt;
-        if (!src.read(buf.get(), sz)) return false;
-        if (!dst.write(buf.get(), sz)) return false;
-        cnt += sz;
-        const int prog_new = int(double(cnt) / n * (prog_end - prog_start)) + prog_start;
-        if (prog_new > prog) cb(prog_new);
-        prog = prog_new;
+// Append `src` to `dest`, adding `offset` to every element.
+template <typename T, typename U>
+void
+append_shifted(std::vector<T>& dest, const std::vector<T>& src, U offset)
+{
+    const auto base = dest.size();
+    dest.resize(base + src.size());
+    T* const out = dest.data() + base;
+    for (std::size_t i = 0; i < src.size(); ++i) {
+        out[i] = src[i] + offset;
+    }
+}
+
+// Have a scanned input refer to its media data in place, as data reference `data_ref_index` of a reference movie:
+// chunk offsets become offsets into the input file itself, and all its sample descriptions point at that data reference.
+bool
+use_external_data(MergeInfo& part, uint16_t data_ref_index)
+{
+    const auto& ranges = part.mdat_ranges.at(0);
+    for (auto& t : part.trak_infos) {
+        ChunkOffsets stco;
+        t.stco.forEach([&](uint64_t offset) { stco.push_back(file_offset(ranges, offset)); });
+        t.stco = std::move(stco);
+        for (auto& s : t.sources) s.external = true;
+
+        // SampleEntry: size, format, 6 reserved bytes, data_reference_index
+        std::size_t pos = 0;
+        for (uint32_t i = 0; i < t.stsd_count; ++i) {
+            if (t.stsd.size() - pos < 16) return false;
+            const auto size = loadBE<uint32_t>(t.stsd.data() + pos);
+            if (size < 16 || size > t.stsd.size() - pos) return false;
+            storeBE(t.stsd.data() + pos + 14, data_ref_index);
+            pos += size;
+        }
+    }
+    return true;
+}
+
+// Append the composition offsets of `part` to those of `t`, which has `samples` samples so far, adding `shift` to each.
+// A track without ctts has offsets of 0 throughout, so the merged one only needs a table once an offset isn't 0.
+bool
+append_ctts(TrackInfo& t, const TrackInfo& part, uint32_t samples, int64_t shift)
+{
+    if (t.ctts.empty() && part.ctts.empty() && shift == 0) return true;
+    if (t.ctts.empty() && samples) t.ctts.push_back({samples, 0});
+
+    const auto base = t.ctts.size();
+    const auto part_samples = sample_count(part);
+    if (part.ctts.empty()) t.ctts.push_back({part_samples, 0});
+    else {
+        uint64_t n = 0;
+        for (const auto& e : part.ctts) n += e[0];
+        if (n != part_samples) return false;
+        t.ctts.insert(t.ctts.end(), part.ctts.begin(), part.ctts.end());
+    }
+    for (auto it = t.ctts.begin() + base; it != t.ctts.end(); ++it) {
+        const auto offset = int64_t(int32_t((*it)[1])) + shift;
+        if (offset < INT32_MIN || offset > INT32_MAX) return false;
+        (*it)[1] = uint32_t(int32_t(offset));
+    }
+    compact_stts(t.ctts, base);
+    return true;
+}
+
+// Append the tables of the next input, as scanned by merge_info(), to the merged info.
+// The offsets to apply are simply the running totals of what has been merged so far.
+// For a `reference` movie, chunks stay in their own input instead, which is selected through the sample description.
+bool
+stitch(MergeInfo& info, MergeInfo& part, bool reference)
+{
+    if (reference && !use_external_data(part, uint16_t(info.mdat_ranges.size() + 1))) return false;
+
+    if (info.mdat_ranges.empty()) { // first input, taken as is
+        info = std::move(part);
+        info.mdat_offset = media_size(info.mdat_ranges.at(0));
+        return true;
+    }
+    // following videos aren't expected to contain additional tracks.
+    if (part.trak_infos.size() > info.trak_infos.size()) return false;
+
+    info.mvhd_duration += part.mvhd_duration;
+    for (std::size_t i = 0; i < part.trak_infos.size(); ++i) {
+        auto& t = info.trak_infos[i];
+        const auto& p = part.trak_infos[i];
+        t.tkhd_duration += p.tkhd_duration;
+        t.mdhd_duration += p.mdhd_duration;
+        if (t.skip) continue; // only the first file's samples are kept
+
+        const auto sample_offset = sample_count(t);
+        const auto chunk_offset = chunk_count(t);
+        const auto sdi_offset = reference ? t.stsd_count : 0;
+        t.elst_segment_duration += p.elst_segment_duration;
+        // Each input's edit list starts its presentation at a media time of its own, while the merged one keeps
+        // the first input's. Shifting the composition times by the difference makes up for that.
+        if (!append_ctts(t, p, sample_offset, t.elst_media_time - p.elst_media_time)) return false;
+        const auto stts_base = t.stts.size();
+        t.stts.insert(t.stts.end(), p.stts.begin(), p.stts.end());
+        compact_stts(t.stts, stts_base);
+        t.stsz.append(p.stsz);
+        t.sdtp.insert(t.sdtp.end(), p.sdtp.begin(), p.sdtp.end());
+        append_shifted(t.stss, p.stss, sample_offset);
+        t.stco.append(p.stco, reference ? 0 : info.mdat_offset);
+        for (auto s : p.sources) {
+            s.file = info.mdat_ranges.size();
+            s.sample_offset = sample_offset;
+            s.chunk_adjust += reference ? 0 : info.mdat_offset;
+            t.sources.push_back(s);
+        }
+        const auto base = t.stsc.size();
+        t.stsc.insert(t.stsc.end(), p.stsc.begin(), p.stsc.end());
+        for (auto it = t.stsc.begin() + base; it != t.stsc.end(); ++it) {
+            (*it)[0] += chunk_offset;
+            (*it)[2] += sdi_offset;
+        }
+        compact_stsc(t.stsc, base); // runs usually carry on across files
+        if (reference) {
+            t.stsd.insert(t.stsd.end(), p.stsd.begin(), p.stsd.end());
+            t.stsd_count += p.stsd_count;
+        }
+    }
+    info.mdat_offset += media_size(part.mdat_ranges.at(0));
+    info.mdat_ranges.push_back(std::move(part.mdat_ranges.at(0)));
+    return true;
+}
+
+// Scan a single input, as validated by check_input(), into its own `part`. Safe to run concurrently for different inputs.
+bool
+scan_input(Mp4Stream& file, MergeInfo& part) noexcept
+{
+    try {
+        // Get mdat info, we've checked there's at least one.
+        const auto& root = file.index();
+        auto& ranges = part.mdat_ranges.emplace_back();
+        for (const auto& box : root) {
+            if (box.atom.fourcc == fourcc("mdat")) ranges.push_back({box.atom.dataOffset(), box.atom.dataSize(), media_size(ranges)});
+        }
+
+        return merge_info(part, file, root, 0);
+    }
+    catch (const error&) {
+        return false;
+    }
+}
+
+// Absolute file:// URL of a local file, as used for the data references of a reference movie.
+// Returns an empty string on error.
+std::string
+file_url(const char* file)
+{
+    std::error_code ec;
+    const auto path = std::filesystem::absolute(file, ec).generic_u8string();
+    if (ec || path.empty()) return {};
+
+    std::string url = path.front() == '/' ? "file://" : "file:///"; // file:///C:/... on Windows
+    for (const unsigned char c : path) {
+        if (std::isalnum(c) || std::strchr("-._~/:!$&'()*+,;=@", c)) {
+            url += char(c);
+        }
+        else {
+            constexpr char hex[] = "0123456789ABCDEF";
+            url += {'%', hex[c >> 4], hex[c & 0xF]};
+        }
+    }
+    return url;
+}
+
+// Run fn(0) ... fn(n-1) on up to `max_threads` threads, the calling one included; 0 for hardware_concurrency().
+template <typename Fn>
+void
+parallel_for(std::size_t n, unsigned max_threads, Fn fn)
+{
+    std::atomic<std::size_t> next = 0;
+    const auto work = [&] {
+        for (auto i = next++; i < n; i = next++) fn(i);
+    };
+
+    const auto nb_threads = std::min<std::size_t>(n, std::max(1u, max_threads ? max_threads : std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < nb_threads; ++i) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto& t : threads) t.join();
+}
+
+// Reports the progress of one join to its JoinProgCb (0, then 1 to 99 as the media data is copied, then 100)
+// and to JoinOptions::progress, and tells when JoinOptions::cancel is set. Only used by the thread running the join.
+class Progress {
+public:
+    using Phase = JoinProgress::Phase;
+
+    Progress(const JoinOptions& options, const JoinProgCb& cb) noexcept
+        : cb(cb), progress_cb(options.progress), cancel(options.cancel), interval(std::chrono::milliseconds(options.progress_interval_ms)) {}
+
+    // Enter `phase`. Always reported.
+    void phase(Phase phase) noexcept {
+        if (current.phase == Phase::Mdat && phase != Phase::Mdat) {
+            // The copy is over: its rate is final, and stays in the reports that follow.
+            current.bytes_per_second = rate(Clock::now());
+        }
+        current.phase = phase;
+        report(phase == Phase::Scan ? 0 : phase == Phase::Done ? 100 : std::max(percent, 1), true);
+    }
+
+    // The media data copy starts, with `total` bytes to go.
+    void startCopy(uint64_t total) noexcept {
+        current.bytes_total = total;
+        current.bytes_done = 0;
+        copy_start = Clock::now();
+        phase(Phase::Mdat);
+    }
+
+    // `n` more bytes of media data are copied. Returns false once the join is to stop.
+    bool advance(uint64_t n) noexcept {
+        current.bytes_done += n;
+        report(int(double(current.bytes_done) / std::max<uint64_t>(current.bytes_total, 1) * 98) + 1, false);
+        return !cancelled();
+    }
+
+    bool cancelled() const noexcept { return cancel && cancel->load(std::memory_order_relaxed); }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void report(int new_percent, bool force) noexcept {
+        if (new_percent > percent) {
+            percent = new_percent;
+            if (cb) cb(percent);
+        }
+        if (!progress_cb) return;
+        const auto now = Clock::now();
+        if (!force && now - last_report < interval) return;
+        last_report = now;
+        current.percent = percent;
+        if (current.phase == Phase::Mdat) current.bytes_per_second = rate(now);
+        progress_cb(current);
+    }
+
+    double rate(Clock::time_point now) const noexcept {
+        const std::chrono::duration<double> elapsed = now - copy_start;
+        return elapsed.count() > 0 ? double(current.bytes_done) / elapsed.count() : 0;
+    }
+
+    const JoinProgCb& cb;
+    const JoinProgressCb& progress_cb;
+    const std::atomic<bool>* const cancel;
+    const Clock::duration interval;
+    JoinProgress current;
+    int percent = -1;          // last one passed to `cb`
+    Clock::time_point copy_start, last_report;
+};
+
+// Keeps the mdat copy from filling the page cache (JoinOptions::bypass_page_cache).
+// The output is written back window by window; once a window is on disk,
+// it is evicted on the output side, and so is the matching range of each input's mdat.
+class CacheBypass {
+public:
+    // `skip` bytes of mdat data, i.e. those of the inputs left out of the copy, are already in the output.
+    CacheBypass(const MergeInfo& info, std::vector<Mp4Stream>& files, BinaryFileStream& output, uint64_t skip) noexcept
+        : info(info), files(files), output(output), out_start(output.tell() < 0 ? -1 : output.tell() - int64_t(skip)),
+          copied(skip), flushed(skip), dropped(skip) {}
+
+    // Account for n more bytes of mdat data written.
+    void advance(uint64_t n) noexcept {
+        copied += n;
+        if (copied - flushed >= window) flush();
+    }
+
+    void finish() noexcept {
+        flush();
+        drop(dropped, flushed);
+    }
+
+private:
+    // Start writeback of the new window, then wait for and evict the one before it.
+    void flush() noexcept {
+        if (out_start >= 0) output.writeBehind(out_start + flushed, copied - flushed);
+        drop(dropped, flushed);
+        dropped = flushed;
+        flushed = copied;
+    }
+
+    // Evict [from, to) of the merged mdat data, output and inputs alike.
+    void drop(uint64_t from, uint64_t to) noexcept {
+        if (from >= to) return;
+        if (out_start >= 0) output.dropCache(out_start + from, to - from);
+
+        uint64_t base = 0;
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            for (const auto& r : info.mdat_ranges.at(i)) {
+                const auto lo = std::max(from, base), hi = std::min(to, base + r.size);
+                // dropCache() widens to whole pages, so the unaligned ends of each mdat go as well.
+                if (lo < hi) files[i].dropCache(r.offset + (lo - base), hi - lo);
+                base += r.size;
+            }
+        }
+    }
+
+    static constexpr uint64_t window = 32*1024*1024;
+
+    const MergeInfo& info;
+    std::vector<Mp4Stream>& files;
+    BinaryFileStream& output;
+    const int64_t out_start; // output offset of the mdat data, -1 if the output isn't seekable
+    uint64_t copied;         // bytes of mdat data written so far
+    uint64_t flushed;        // writeback started up to here
+    uint64_t dropped;        // evicted up to here
+};
+
+// Copy the mdat data of every input from `first` on to the output, reporting progress from 1 to 99.
+// Stops at the next buffer boundary once the join is cancelled.
+// The kernel moves the data if it can (see BinaryFileStream::transferFrom()).
+// Once it refuses, everything left goes through io_uring (if enabled and available), or else a pipelined read/write copy.
+bool
+copy_mdat(const MergeInfo& info, std::vector<Mp4Stream>& files, BinaryStream& output, const JoinOptions& options, Progress& progress,
+          const JoinResources& res, std::size_t first = 0)
+{
+    constexpr std::size_t chunk_size = 4*1024*1024; // per kernel copy call
+    constexpr std::size_t nb_buffers = 4;
+    constexpr std::size_t ring_chunk_size = 1024*1024;
+    constexpr unsigned ring_depth = 32;
+
+    // The kernel copy, io_uring and the cache bypass need files on both ends.
+    auto* const out_file = dynamic_cast<BinaryFileStream*>(&output);
+    std::uint64_t mdat_size_skipped = 0;
+    for (std::size_t i = 0; i < first; ++i) {
+        mdat_size_skipped += media_size(info.mdat_ranges.at(i));
+    }
+    std::optional<CacheBypass> bypass;
+    if (options.bypass_page_cache && out_file) bypass.emplace(info, files, *out_file, mdat_size_skipped);
+
+    std::uint64_t mdat_size_sum = 0; // for calculating progress
+    for (auto i = first; i < files.size(); ++i) {
+        mdat_size_sum += media_size(info.mdat_ranges.at(i));
+    }
+    progress.startCopy(mdat_size_sum);
+    const auto advance = [&](std::size_t n) {
+        if (bypass) bypass->advance(n);
+        return progress.advance(n);
+    };
+
+    // Every mdat payload is an extent of its own, in order.
+    std::vector<CopyExtent> extents;
+    std::vector<Mp4Stream*> owners; // input of each extent
+    for (auto i = first; i < files.size(); ++i) {
+        BinaryStreamBase* const src = files[i].file() ? static_cast<BinaryStreamBase*>(files[i].file()) : &files[i];
+        for (const auto& r : info.mdat_ranges.at(i)) {
+            extents.push_back({src, int64_t(r.offset), r.size});
+            owners.push_back(&files[i]);
+        }
+    }
+
+    bool ok = true;
+    std::size_t next = 0; // extents before it are copied
+    for (; ok && next < extents.size() && out_file && owners[next]->file(); ++next) {
+        auto& e = extents[next];
+        owners[next]->seek(e.offset);
+        while (ok && e.size > 0) {
+            const auto sz = std::size_t(std::min<uint64_t>(e.size, chunk_size));
+            const auto moved = out_file->transferFrom(*owners[next]->file(), sz);
+            e.offset += int64_t(moved);
+            e.size -= moved;
+            ok = advance(moved);
+            if (moved < sz) break;
+        }
+        if (e.size > 0) break;
+    }
+
+    if (ok && next < extents.size()) {
+        // The kernel refused (or can't help), copy all that's left ourselves.
+        for (auto i = next; i < extents.size(); ++i) owners[i]->adviseSequential(uint64_t(extents[i].offset), extents[i].size);
+        extents.erase(extents.begin(), extents.begin() + std::ptrdiff_t(next));
+        const auto ret = options.io_uring && out_file ? uring_copy(*out_file, extents, ring_chunk_size, ring_depth, advance) : RingCopyResult::Unavailable;
+        if (ret != RingCopyResult::Unavailable) ok = ret == RingCopyResult::Done;
+        else ok = pipelined_copy(output, extents, res.bufsize, nb_buffers, advance, res.pool);
+    }
+
+    if (bypass) bypass->finish();
+    return ok;
+}
+
+// Encode `src` as a table of fixed-size big-endian entries at the current position of `out`.
+// Counterpart of append_table().
+template <std::size_t EntrySize, typename T, typename Encode>
+bool
+put_table(BinaryMemoryStream& out, const std::vector<T>& src, Encode encode)
+{
+    unsigned char* const p = out.extend(src.size() * EntrySize);
+    if (!p) return false;
+    for (std::size_t i = 0; i < src.size(); ++i) {
+        encode(p + i * EntrySize, src[i]);
     }
     return true;
 }
 
+// Final stco or co64 payload of a track, for mdat data starting at `mdat_final_position` in the output.
+void
+encode_chunk_offsets(const TrackInfo& track, uint64_t mdat_final_position, bool co64, unsigned char* dst)
+{
+    if (co64) {
+        track.stco.forEach([&](uint64_t offset) { storeBE(dst, offset + mdat_final_position); dst += 8; });
+    }
+    else {
+        track.stco.forEach([&](uint64_t offset) { storeBE(dst, uint32_t(offset + mdat_final_position)); dst += 4; });
+    }
+}
+
+// Data information box of a reference movie, with one external `url ' entry per input.
 // Returns bytes written or error.
 std::optional<int64_t>
-write_joined(MergeInfo& info, std::vector<Mp4Stream>& files, BinaryFileStream& output, std::size_t track_id, int64_t max_read, const JoinProgCb& cb)
+write_dinf(const std::vector<std::string>& urls, BinaryMemoryStream& output)
 {
-    // We don't do additional checking here...
-    if (files.size() < 2) return {};
-    auto& ref = files.front();
-    const auto start_pos = ref.tell();
-    if (start_pos < 0 || start_pos >= ref.getLength()) return {};
+    uint64_t dref_size = 8 + 4 + 4;
+    for (const auto& url : urls) {
+        dref_size += 8 + 4 + url.size() + 1; // null-terminated location
+    }
+    bool ok = output.writeNum(uint32_t(8 + dref_size)) && output.writeNum(fourcc("dinf"))
+           && output.writeNum(uint32_t(dref_size)) && output.writeNum(fourcc("dref"))
+           && output.writeNum(uint32_t(0)) && output.writeNum(uint32_t(urls.size()));
+    for (const auto& url : urls) {
+        // flags 0: the media data is not in this file.
+        ok = ok && output.writeNum(uint32_t(8 + 4 + url.size() + 1)) && output.writeNum(fourcc("url "))
+                && output.writeNum(uint32_t(0)) && output.write(url.c_str(), url.size() + 1);
+    }
+    if (!ok) return {};
+    return 8 + dref_size;
+}
+
+// Whether a merged track has negative composition offsets, which take a version 1 ctts.
+bool
+signed_ctts(const TrackInfo& t)
+{
+    return std::any_of(t.ctts.begin(), t.ctts.end(), [](const auto& x) { return int32_t(x[1]) < 0; });
+}
 
+// Write the merged version of the boxes [first, last) of the reference file's index.
+// This only ever runs inside moov, which is serialized in memory; see plan_layout().
+// Returns bytes written or error.
+std::optional<int64_t>
+write_boxes(MergeInfo& info, Mp4Stream& ref, std::vector<Mp4Stream::Box>::const_iterator first, std::vector<Mp4Stream::Box>::const_iterator last,
+            BinaryMemoryStream& output, std::size_t track_id)
+{
     int64_t total_written = 0;
-    for(;;)
+    for (auto box = first; box != last; ++box)
     {
-        const auto atom = ref.parseAtom();
+        const auto& atom = box->atom;
         auto new_size = atom.size; // actual output size of this atom
         if(should_descend(atom.fourcc)) {
             // Copy the header first
             ref.seek(atom.offset);
             const auto out_header_offset = output.tell();
-            output.copyFrom(ref, atom.header_size, 1024);
+            if(!output.copyFrom(ref, atom.header_size)) return {};
             // Descend.
-            const auto ret = write_joined(info, files, output, track_id, atom.dataSize(), cb);
+            const auto ret = write_boxes(info, ref, box->children.begin(), box->children.end(), output, track_id);
             if(!ret) return {};
             new_size = ret.value() + atom.header_size;
 
@@ -310,53 +983,20 @@ write_joined(MergeInfo& info, std::vector<Mp4Stream>& files, BinaryFileStream& o
             }
 
             if(new_size != atom.size) {
-                output.patchNum(out_header_offset, uint32_t(new_size));
+                if(atom.header_size == 16) output.patchNum(out_header_offset + 8, uint64_t(new_size));
+                else                       output.patchNum(out_header_offset, uint32_t(new_size));
             }
         }
-        else if(atom.fourcc == fourcc("mdat")) {
-            // Write as extended mdat box.
-            output.writeNum(uint32_t(1));
-            output.writeNum(fourcc("mdat"));
-            const auto mdat_extended_size_pos = output.tell();
-            output.writeNum(uint64_t(0)); // re-write later
-            new_size = 16;
-            // Now we're at mdat data start.
-            info.mdat_final_position = output.tell();
-
-            std::uint64_t mdat_size_sum = 0; // for calculating progress
-            for (const auto& mdat : info.mdat_position) {
-                mdat_size_sum += mdat[1];
-            }
-            std::uint64_t mdat_size_copied = 0;
-            for (std::size_t file_id=0; file_id<files.size(); ++file_id) {
-                auto& f = files[file_id];
-                const auto& [data_offset, data_size] = info.mdat_position.at(file_id);
-                f.seek(data_offset);
-                if (cb) {
-                    const int prog_start = int(double(mdat_size_copied) / mdat_size_sum * 98) + 1;
-                    const int prog_end = int(double(mdat_size_copied += data_size) / mdat_size_sum * 98) + 1;
-                    if (!copyWithJoinProg(output, f, data_size, 4*1024*1024, cb, prog_start, prog_end)) return {};
-                }
-                else {
-                    if (!output.copyFrom(f, data_size)) return {};
-                }
-                new_size += data_size;
-            }
-
-            // patch final size
-            output.patchNum(mdat_extended_size_pos, new_size);
-
-            ref.seek(atom.endOffset());
-        }
         else if(eq_one(atom.fourcc, fourcc("mvhd"), fourcc("tkhd"), fourcc("mdhd"), fourcc("elst"))) {
             uint8_t ver; uint32_t _flags;
+            ref.seek(atom.dataOffset());
             ref.readNumEx(ver);
             ref.readNumEx<Endian::BE, uint32_t, 3>(_flags);
 
             // Copy original box, then patch value.
             ref.seek(atom.offset);
             const auto pos = output.tell() + atom.header_size + 4; // after version & flags
-            output.copyFrom(ref, atom.size, 1024);
+            if(!output.copyFrom(ref, atom.size)) return {};
 
             if(atom.fourcc == fourcc("mvhd")) {
                 if(ver==1) output.patchNum(pos+8+8+4, info.mvhd_duration);
@@ -379,89 +1019,93 @@ write_joined(MergeInfo& info, std::vector<Mp4Stream>& files, BinaryFileStream& o
                 }
             }
         }
-        else if(eq_one(atom.fourcc, fourcc("stts"), fourcc("stsz"), fourcc("stss"), fourcc("stco"), fourcc("co64"), fourcc("sdtp"), fourcc("stsc")))
+        else if(eq_one(atom.fourcc, fourcc("stts"), fourcc("ctts"), fourcc("stsz"), fourcc("stss"), fourcc("stco"), fourcc("co64"), fourcc("sdtp"), fourcc("stsc")))
         {
-            // We'll write these boxes using only the merged info,
-            // so skip to the end.
-            ref.seek(atom.endOffset());
-
-            const auto out_pos = output.tell();
-            output.writeNum(uint32_t(0)); // patch later
-            output.writeNum( atom.fourcc == fourcc("stco") ? fourcc("co64") : atom.fourcc );
-            output.writeNum(uint32_t(0)); // version/flags
-            new_size = 12;
-
+            // We'll write these boxes using only the merged info.
             if(track_id >= info.trak_infos.size()) return {};
             auto& track_info = info.trak_infos[track_id];
 
-            if(atom.fourcc == fourcc("stts")) {
-                // Merge entries with the same duration. Is this necessary to be conformant?
-                decltype(track_info.stts) new_stts;
-                uint32_t current_duration{};
-                for (const auto& [count, duration] : track_info.stts) {
-                    if (!new_stts.empty() && current_duration == duration) {
-                        new_stts.back()[0] += count;
-                    }
-                    else {
-                        current_duration = duration;
-                        new_stts.push_back({count, duration});
-                    }
-                }
+            // stts, ctts and stsc are run-length already, and stsz is constant where possible.
+            // The size is known up front, so the header goes out in its final form.
+            const auto entries = entries_size(track_info, atom.fourcc, info.co64);
+            new_size = 12 + (atom.fourcc == fourcc("stsz") ? 8 : atom.fourcc == fourcc("sdtp") ? 0 : 4) + entries;
+            output.writeNum(uint32_t(new_size));
+            if (eq_one(atom.fourcc, fourcc("stco"), fourcc("co64"))) output.writeNum(info.co64 ? fourcc("co64") : fourcc("stco"));
+            else                                                      output.writeNum(atom.fourcc);
+            output.writeNum(uint32_t(atom.fourcc == fourcc("ctts") && signed_ctts(track_info)) << 24); // version/flags
 
-                output.writeNum(uint32_t(new_stts.size()));
-                new_size += 4;
-                for (const auto& [count, duration] : new_stts) {
-                    output.writeNum(count);
-                    output.writeNum(duration);
-                    new_size += 8;
+            bool ok = true;
+            if(info.streamed && eq_one(atom.fourcc, fourcc("stsz"), fourcc("stco"), fourcc("co64"), fourcc("stss"), fourcc("sdtp"))) {
+                // Only the counts go in now, the entries follow in write_moov().
+                if(atom.fourcc == fourcc("stsz")) {
+                    ok = output.writeNum(constant_sample_size(track_info)) && output.writeNum(sample_count(track_info));
                 }
+                else if(atom.fourcc != fourcc("sdtp")) {
+                    ok = output.writeNum(uint32_t(entries / (atom.fourcc == fourcc("stss") ? 4 : info.co64 ? 8 : 4)));
+                }
+                if(entries) info.streamed_tables.push_back({uint64_t(output.tell()), track_id, atom.fourcc});
             }
-            if(atom.fourcc == fourcc("stsz")) {
-                output.writeNum(track_info.stsz_sample_size);
-                output.writeNum(track_info.stsz_count);
-                new_size += 8;
-                for (const auto& x : track_info.stsz) {
-                    output.writeNum(x);
-                    new_size += 4;
+            else if(atom.fourcc == fourcc("stts")) {
+                output.writeNum(uint32_t(track_info.stts.size()));
+                ok = put_table<8>(output, track_info.stts, [](unsigned char* e, const std::array<uint32_t, 2>& x) {
+                    storeBE(e, x[0]); storeBE(e + 4, x[1]);
+                });
+                // Inputs after the first may bring composition offsets the first one doesn't have. ctts follows stts then.
+                const bool ref_ctts = std::any_of(first, last, [](const Mp4Stream::Box& b) { return b.atom.fourcc == fourcc("ctts"); });
+                if(ok && !ref_ctts && !track_info.ctts.empty()) {
+                    const auto ctts_size = 16 + entries_size(track_info, fourcc("ctts"), false);
+                    ok = output.writeNum(uint32_t(ctts_size)) && output.writeNum(fourcc("ctts"))
+                      && output.writeNum(uint32_t(signed_ctts(track_info)) << 24) && output.writeNum(uint32_t(track_info.ctts.size()))
+                      && put_table<8>(output, track_info.ctts, [](unsigned char* e, const std::array<uint32_t, 2>& x) {
+                          storeBE(e, x[0]); storeBE(e + 4, x[1]);
+                      });
+                    new_size += ctts_size;
                 }
             }
-            if(atom.fourcc == fourcc("stss")) {
+            else if(atom.fourcc == fourcc("ctts")) {
+                output.writeNum(uint32_t(track_info.ctts.size()));
+                ok = put_table<8>(output, track_info.ctts, [](unsigned char* e, const std::array<uint32_t, 2>& x) {
+                    storeBE(e, x[0]); storeBE(e + 4, x[1]);
+                });
+            }
+            else if(atom.fourcc == fourcc("stsz")) {
+                output.writeNum(track_info.stsz.constantSize());
+                output.writeNum(track_info.stsz.count());
+                ok = put_table<4>(output, track_info.stsz.table(), [](unsigned char* e, uint32_t x) { storeBE(e, x); });
+            }
+            else if(atom.fourcc == fourcc("stss")) {
                 output.writeNum(uint32_t(track_info.stss.size()));
-                new_size += 4;
-                for (const auto& x : track_info.stss) {
-                    output.writeNum(x);
-                    new_size += 4;
-                }
+                ok = put_table<4>(output, track_info.stss, [](unsigned char* e, uint32_t x) { storeBE(e, x); });
             }
-            if(atom.fourcc == fourcc("stco") || atom.fourcc == fourcc("co64")) {
+            else if(atom.fourcc == fourcc("stco") || atom.fourcc == fourcc("co64")) {
                 output.writeNum(uint32_t(track_info.stco.size()));
-                new_size += 4;
-
+                // Filled in by plan_layout(), once the final mdat position is known.
                 track_info.co64_final_position = output.tell();
-
-                for ([[maybe_unused]] const auto& x : track_info.stco) {
-                    output.writeNum(uint64_t(0)); // patch after exiting this function.
-                    new_size += 8;
-                }
+                ok = output.extend(std::size_t(entries)) != nullptr;
             }
-            if(atom.fourcc == fourcc("sdtp")) {
-                for (const auto& x : track_info.sdtp) {
-                    output.writeNum(x);
-                    new_size += sizeof(x);
-                }
+            else if(atom.fourcc == fourcc("sdtp")) {
+                ok = output.write(track_info.sdtp.data(), track_info.sdtp.size());
             }
-            if(atom.fourcc == fourcc("stsc")) {
+            else if(atom.fourcc == fourcc("stsc")) {
                 output.writeNum(uint32_t(track_info.stsc.size()));
-                new_size += 4;
-                for (const auto& [x1, x2, x3] : track_info.stsc) {
-                    output.writeNum(x1);
-                    output.writeNum(x2);
-                    output.writeNum(x3);
-                    new_size += 12;
-                }
+                ok = put_table<12>(output, track_info.stsc, [](unsigned char* e, const std::array<uint32_t, 3>& x) {
+                    storeBE(e, x[0]); storeBE(e + 4, x[1]); storeBE(e + 8, x[2]);
+                });
             }
-            // patch atom size
-            output.patchNum(out_pos, uint32_t(new_size));
+            if(!ok) return {};
+        }
+        else if(!info.data_refs.empty() && atom.fourcc == fourcc("dinf")) {
+            const auto ret = write_dinf(info.data_refs, output);
+            if(!ret) return {};
+            new_size = ret.value();
+        }
+        else if(!info.data_refs.empty() && atom.fourcc == fourcc("stsd")) {
+            // Sample descriptions of all inputs, each pointing at its own data reference; see stitch().
+            if(track_id >= info.trak_infos.size()) return {};
+            const auto& track_info = info.trak_infos[track_id];
+            new_size = 12 + 4 + track_info.stsd.size();
+            if(!output.writeNum(uint32_t(new_size)) || !output.writeNum(fourcc("stsd")) || !output.writeNum(uint32_t(0))
+               || !output.writeNum(track_info.stsd_count) || !output.write(track_info.stsd.data(), track_info.stsd.size())) return {};
         }
         else {  // Opaque boxes, just copy through.
             ref.seek(atom.offset);
@@ -469,78 +1113,878 @@ write_joined(MergeInfo& info, std::vector<Mp4Stream>& files, BinaryFileStream& o
         }
 
         total_written += new_size;
-
-        if(ref.tell() - start_pos >= max_read) break;
     }
 
     return total_written;
 }
 
-} // unnamed ns
+// Output layout, fully worked out before the first byte is written.
+// With it, the output is written strictly sequentially and never needs to be seekable.
+struct JoinLayout {
+    std::vector<Mp4Stream::AtomInfo> root_atoms; // root boxes of the reference file, in output order
+    BinaryMemoryStream moov;                     // the merged moov, with final chunk offsets
+    uint64_t mdat_size;                          // size of the output mdat box, header included
+};
+
+// Plan the joined file, following the root box order of the first input.
+// With `faststart`, moov is moved in front of mdat. A reference movie has no mdat at all.
+// Fills in `info.mdat_final_position` and serializes moov for it.
+bool
+plan_layout(MergeInfo& info, std::vector<Mp4Stream>& files, bool faststart, JoinLayout& layout)
+{
+    auto& ref = files.front();
+    const auto& root = ref.index();
+
+    layout.mdat_size = 16; // Written as extended mdat box.
+    for (const auto& ranges : info.mdat_ranges) {
+        layout.mdat_size += media_size(ranges);
+    }
+
+    // All media data goes into a single mdat, where the first one was.
+    bool has_mdat = false;
+    for (const auto& box : root) {
+        if (box.atom.fourcc == fourcc("mdat")) {
+            if (!info.data_refs.empty() || has_mdat) continue;
+            has_mdat = true;
+        }
+        layout.root_atoms.push_back(box.atom);
+    }
+    const auto moov_box = std::find_if(root.begin(), root.end(), [](const auto& b) { return b.atom.fourcc == fourcc("moov"); });
+
+    auto& atoms = layout.root_atoms;
+    if(faststart) {
+        const auto mdat = std::find_if(atoms.begin(), atoms.end(), [](const auto& a) { return a.fourcc == fourcc("mdat"); });
+        const auto moov = std::find_if(atoms.begin(), atoms.end(), [](const auto& a) { return a.fourcc == fourcc("moov"); });
+        if(moov != atoms.end() && moov > mdat) std::rotate(mdat, moov, moov + 1); // moov goes right before mdat, the rest keeps its order
+    }
+
+    // moov's size doesn't depend on where things go, so a single walk settles every offset.
+    // Chunk offsets of a reference movie are final already.
+    // 32-bit stco is tried first; if the offsets end up too large for it, moov grows and is laid out again with co64.
+    info.co64 = false;
+    for (;;) {
+        info.mdat_final_position = 0;
+        info.streamed_tables.clear();
+        layout.moov.clear();
+        uint64_t out_pos = 0;
+        for (const auto& atom : atoms)
+        {
+            if(atom.fourcc == fourcc("mdat")) {
+                info.mdat_final_position = out_pos + 16;
+                out_pos += layout.mdat_size;
+            }
+            else if(atom.fourcc == fourcc("moov")) {
+                const auto moov_size = write_boxes(info, ref, moov_box, moov_box + 1, layout.moov, 0); // streamed tables included
+                if(!moov_size) return false;
+                out_pos += moov_size.value();
+            }
+            else {
+                out_pos += atom.size;
+            }
+        }
+
+        const bool fits = std::all_of(info.trak_infos.begin(), info.trak_infos.end(), [&](const TrackInfo& t) {
+            return max_chunk_offset(info, t) + info.mdat_final_position <= UINT32_MAX;
+        });
+        if (info.co64 || fits) break;
+        info.co64 = true;
+    }
+
+    // Every box size is known now, and so is where the mdat data goes.
+    if (info.streamed) return true; // see write_moov()
+    for (const auto& track : info.trak_infos) {
+        encode_chunk_offsets(track, info.mdat_final_position, info.co64, layout.moov.data() + track.co64_final_position);
+    }
+    return true;
+}
+
+// Fragmented output (JoinOptions::fragmented): an init segment, i.e. moov without samples plus mvex,
+// followed by moof/mdat pairs built straight from the merged sample tables.
+
+// Walks the samples of a merged track in decode order, without expanding its tables.
+class SampleCursor {
+public:
+    explicit SampleCursor(const TrackInfo& track) noexcept : t(track) {
+        stts_left = t.stts.empty() ? 0 : t.stts[0][0];
+        skipEmptyStts();
+        ctts_left = t.ctts.empty() ? 0 : t.ctts[0][0];
+        skipEmptyCtts();
+        if (!done()) enterChunk();
+    }
+
+    bool done() const noexcept { return sample >= t.stsz.count(); }
+    bool ok() const noexcept { return valid; } // false once the tables turned out inconsistent
+
+    uint64_t dts() const noexcept { return time; }
+    uint32_t duration() const noexcept { return stts_i < t.stts.size() ? t.stts[stts_i][1] : 0; }
+    uint32_t compositionOffset() const noexcept { return ctts_i < t.ctts.size() ? t.ctts[ctts_i][1] : 0; } // int32 really
+    uint32_t size() const noexcept { return t.stsz[sample]; }
+    uint64_t offset() const noexcept { return pos; } // within the merged mdat data, like the chunk offsets
+    bool sync() const noexcept { return t.stss.empty() || (stss_i < t.stss.size() && t.stss[stss_i] == sample + 1); }
+
+    void next() noexcept {
+        time += duration();
+        pos += size();
+        if (stss_i < t.stss.size() && t.stss[stss_i] <= sample + 1) ++stss_i;
+        ++sample;
+        if (stts_left) --stts_left;
+        skipEmptyStts();
+        if (ctts_left) --ctts_left;
+        skipEmptyCtts();
+        if (--chunk_left == 0 && !done()) {
+            ++chunk;
+            enterChunk();
+        }
+    }
+
+private:
+    void skipEmptyStts() noexcept {
+        while (stts_left == 0 && stts_i + 1 < t.stts.size()) stts_left = t.stts[++stts_i][0];
+    }
+    void skipEmptyCtts() noexcept {
+        while (ctts_left == 0 && ctts_i + 1 < t.ctts.size()) ctts_left = t.ctts[++ctts_i][0];
+    }
+
+    // Position at the first sample of `chunk`, skipping chunks without samples.
+    void enterChunk() noexcept {
+        for (;;) {
+            while (stsc_i + 1 < t.stsc.size() && t.stsc[stsc_i + 1][0] <= chunk + 1) ++stsc_i;
+            if (chunk >= t.stco.size() || stsc_i >= t.stsc.size()
+                || (!t.stsz.constantSize() && t.stsz.table().size() < t.stsz.count())) {
+                valid = false;
+                sample = t.stsz.count(); // done()
+                return;
+            }
+            chunk_left = t.stsc[stsc_i][1];
+            pos = t.stco[chunk];
+            if (chunk_left) return;
+            ++chunk;
+        }
+    }
+
+    const TrackInfo& t;
+    uint32_t sample = 0;
+    uint64_t time = 0;
+    std::size_t stts_i = 0;
+    uint32_t stts_left = 0;
+    std::size_t ctts_i = 0;
+    uint32_t ctts_left = 0;
+    std::size_t stsc_i = 0;
+    std::size_t chunk = 0;
+    uint32_t chunk_left = 0;
+    uint64_t pos = 0;
+    std::size_t stss_i = 0;
+    bool valid = true;
+};
+
+// Merged info with all sample tables left empty, for the moov of the init segment.
+MergeInfo
+init_segment_info(const MergeInfo& info)
+{
+    MergeInfo init{};
+    init.mvhd_duration = info.mvhd_duration;
+    init.mdat_ranges = info.mdat_ranges;
+    for (const auto& t : info.trak_infos) {
+        auto& i = init.trak_infos.emplace_back();
+        i.track_id = t.track_id;
+        i.timescale = t.timescale;
+        i.tkhd_duration = t.tkhd_duration;
+        i.elst_segment_duration = t.elst_segment_duration;
+        i.mdhd_duration = t.mdhd_duration;
+        i.skip = t.skip;
+    }
+    return init;
+}
+
+// Append mvex to the serialized moov of an init segment, with the total duration and a trex per track.
+bool
+append_mvex(const MergeInfo& info, BinaryMemoryStream& moov)
+{
+    const auto mvex_size = uint32_t(8 + 20 + 32 * info.trak_infos.size());
+    moov.seek(0, From::End);
+    bool ok = moov.writeNum(mvex_size) && moov.writeNum(fourcc("mvex"))
+           && moov.writeNum(uint32_t(20)) && moov.writeNum(fourcc("mehd")) && moov.writeNum(uint32_t(1) << 24) // version 1
+           && moov.writeNum(info.mvhd_duration);
+    for (const auto& t : info.trak_infos) {
+        ok = ok && moov.writeNum(uint32_t(32)) && moov.writeNum(fourcc("trex")) && moov.writeNum(uint32_t(0))
+                && moov.writeNum(t.track_id)
+                && moov.writeNum(uint32_t(1))  // default_sample_description_index
+                && moov.writeNum(uint32_t(0))  // default_sample_duration
+                && moov.writeNum(uint32_t(0))  // default_sample_size
+                && moov.writeNum(uint32_t(0)); // default_sample_flags
+    }
+    if (!ok) return false;
+
+    if (loadBE<uint32_t>(moov.data()) == 1) return moov.patchNum(8, uint64_t(moov.size()));
+    return moov.patchNum(0, uint32_t(moov.size()));
+}
+
+// trun sample_flags: sample_depends_on, sample_is_non_sync_sample
+constexpr uint32_t sync_sample_flags = 0x02000000;
+constexpr uint32_t non_sync_sample_flags = 0x01010000;
+
+// A fragment normally ends at the first sync sample of the lead track that's at least this far (in seconds) from its start.
+// This keeps intra-only video from ending up with one fragment per frame.
+constexpr double min_fragment_duration = 1.0;
+
+// Write every sample as movie fragments, reporting progress from 1 to 99. Stops early like copy_mdat().
+// Each fragment holds one run per track, cut at sync samples of the first track that has a stss;
+// other tracks follow by decode time.
+bool
+write_fragments(const MergeInfo& info, std::vector<Mp4Stream>& files, BinaryStream& output, Progress& progress, const JoinResources& res)
+{
+    constexpr std::size_t nb_buffers = 4;
+
+    // Where each mdat payload starts within the merged mdat data, i.e. in chunk offset terms, and its input.
+    std::vector<uint64_t> data_start;
+    std::vector<std::pair<std::size_t, MdatRange>> data_ranges;
+    uint64_t mdat_size_sum = 0;
+    for (std::size_t i = 0; i < info.mdat_ranges.size(); ++i) {
+        for (const auto& r : info.mdat_ranges[i]) {
+            data_start.push_back(mdat_size_sum);
+            data_ranges.push_back({i, r});
+            mdat_size_sum += r.size;
+        }
+    }
+
+    const auto nb_tracks = info.trak_infos.size();
+    std::vector<SampleCursor> cursors(info.trak_infos.begin(), info.trak_infos.end());
+    std::size_t lead = 0;
+    {
+        const auto& tracks = info.trak_infos;
+        auto it = std::find_if(tracks.begin(), tracks.end(), [](const auto& t) { return !t.skip && !t.stss.empty(); });
+        if (it == tracks.end()) it = std::find_if(tracks.begin(), tracks.end(), [](const auto& t) { return !t.skip; });
+        if (it != tracks.end()) lead = std::size_t(it - tracks.begin());
+    }
+    for (const auto& t : info.trak_infos) {
+        if (t.timescale == 0) return false;
+    }
+
+    struct TrackRun {
+        uint64_t base_time;
+        std::vector<std::array<uint32_t, 4>> samples; // duration, size, flags, composition offset
+        std::vector<CopyExtent> extents;
+    };
+    std::vector<TrackRun> runs(nb_tracks);
+
+    // Add the sample under `c` to `run`, and move on.
+    const auto take = [&](SampleCursor& c, TrackRun& run) {
+        if (run.samples.empty()) run.base_time = c.dts();
+        const auto size = c.size();
+        run.samples.push_back({c.duration(), size, c.sync() ? sync_sample_flags : non_sync_sample_flags, c.compositionOffset()});
+
+        const auto k = std::size_t(std::upper_bound(data_start.begin(), data_start.end(), c.offset()) - data_start.begin()) - 1;
+        const auto& [file_id, range] = data_ranges[k];
+        const auto rel = c.offset() - data_start[k];
+        if (rel + size > range.size) return false; // sample outside of mdat
+        const auto offset = int64_t(range.offset + rel);
+        auto& ext = run.extents;
+        if (!ext.empty() && ext.back().src == &files[file_id] && ext.back().offset + int64_t(ext.back().size) == offset) {
+            ext.back().size += size;
+        }
+        else {
+            ext.push_back({&files[file_id], offset, size});
+        }
+        c.next();
+        return true;
+    };
+
+    progress.startCopy(mdat_size_sum);
+    const auto advance = [&](std::size_t n) { return progress.advance(n); };
+
+    BinaryMemoryStream moof;
+    std::vector<CopyExtent> extents;
+    CopyPipeline pipeline(res.bufsize, nb_buffers, res.pool); // one reader thread for all fragments
+    for (uint32_t sequence_number = 1; ; ++sequence_number) {
+        for (auto& run : runs) {
+            run.samples.clear();
+            run.extents.clear();
+        }
+
+        // The lead track decides where the fragment ends.
+        double end = std::numeric_limits<double>::infinity();
+        {
+            auto& c = cursors[lead];
+            const auto ts = double(info.trak_infos[lead].timescale);
+            const auto start = c.dts();
+            while (!c.done()) {
+                if (!runs[lead].samples.empty() && c.sync() && (c.dts() - start) / ts >= min_fragment_duration) {
+                    end = c.dts() / ts;
+                    break;
+                }
+                if (!take(c, runs[lead])) return false;
+            }
+        }
+        for (std::size_t i = 0; i < nb_tracks; ++i) {
+            if (i == lead) continue;
+            auto& c = cursors[i];
+            const auto ts = double(info.trak_infos[i].timescale);
+            while (!c.done() && c.dts() / ts < end) {
+                if (!take(c, runs[i])) return false;
+            }
+        }
+        for (const auto& c : cursors) {
+            if (!c.ok()) return false;
+        }
+
+        // Composition offsets go in the trun of tracks that have any, signed ones in version 1.
+        const auto entry_size = [&](std::size_t i) -> uint64_t { return info.trak_infos[i].ctts.empty() ? 12 : 16; };
+        uint64_t moof_size = 8 + 16;
+        uint64_t data_size = 0;
+        for (std::size_t i = 0; i < nb_tracks; ++i) {
+            const auto& run = runs[i];
+            if (run.samples.empty()) continue;
+            moof_size += 8 + 16 + 20 + 20 + entry_size(i) * run.samples.size();
+            for (const auto& e : run.extents) data_size += e.size;
+        }
+        if (moof_size == 8 + 16) break; // all samples written
+        if (moof_size > UINT32_MAX) return false;
+        const uint64_t mdat_header_size = 8 + data_size > UINT32_MAX ? 16 : 8;
+
+        moof.clear();
+        bool ok = moof.writeNum(uint32_t(moof_size)) && moof.writeNum(fourcc("moof"))
+               && moof.writeNum(uint32_t(16)) && moof.writeNum(fourcc("mfhd")) && moof.writeNum(uint32_t(0)) && moof.writeNum(sequence_number);
+        auto data_offset = moof_size + mdat_header_size;
+        extents.clear();
+        for (std::size_t i = 0; i < nb_tracks; ++i) {
+            const auto& run = runs[i];
+            if (run.samples.empty()) continue;
+            const auto& track = info.trak_infos[i];
+            const bool cto = !track.ctts.empty();
+            const auto trun_size = 20 + entry_size(i) * run.samples.size();
+            ok = ok && data_offset <= INT32_MAX
+                    && moof.writeNum(uint32_t(8 + 16 + 20 + trun_size)) && moof.writeNum(fourcc("traf"))
+                    && moof.writeNum(uint32_t(16)) && moof.writeNum(fourcc("tfhd"))
+                    && moof.writeNum(uint32_t(0x020000)) // default-base-is-moof
+                    && moof.writeNum(track.track_id)
+                    && moof.writeNum(uint32_t(20)) && moof.writeNum(fourcc("tfdt")) && moof.writeNum(uint32_t(1) << 24) // version 1
+                    && moof.writeNum(run.base_time)
+                    && moof.writeNum(uint32_t(trun_size)) && moof.writeNum(fourcc("trun"))
+                    // data-offset, sample-duration, sample-size, sample-flags (and sample-composition-time-offset) present
+                    && moof.writeNum(cto ? uint32_t(signed_ctts(track)) << 24 | 0x000F01 : uint32_t(0x000701))
+                    && moof.writeNum(uint32_t(run.samples.size())) && moof.writeNum(uint32_t(data_offset))
+                    && (cto ? put_table<16>(moof, run.samples, [](unsigned char* e, const std::array<uint32_t, 4>& x) {
+                                  storeBE(e, x[0]); storeBE(e + 4, x[1]); storeBE(e + 8, x[2]); storeBE(e + 12, x[3]);
+                              })
+                            : put_table<12>(moof, run.samples, [](unsigned char* e, const std::array<uint32_t, 4>& x) {
+                                  storeBE(e, x[0]); storeBE(e + 4, x[1]); storeBE(e + 8, x[2]);
+                              }));
+            for (const auto& e : run.extents) data_offset += e.size;
+            extents.insert(extents.end(), run.extents.begin(), run.extents.end());
+        }
+        if (!ok) return false;
+
+        if (!output.write(moof.data(), moof.size())) return false;
+        if (mdat_header_size == 16) ok = output.writeNum(uint32_t(1)) && output.writeNum(fourcc("mdat")) && output.writeNum(16 + data_size);
+        else                        ok = output.writeNum(uint32_t(8 + data_size)) && output.writeNum(fourcc("mdat"));
+        if (!ok || !pipeline.copy(output, extents, advance)) return false;
+    }
+
+    return true;
+}
+
+// Stream the entries of a table left out of the serialized moov from the inputs to the output,
+// adjusting them on the way just like stitch() and encode_chunk_offsets() do.
+bool
+stream_table(const MergeInfo& info, std::vector<Mp4Stream>& files, const StreamedTable& table, BinaryStream& output)
+{
+    const auto& t = info.trak_infos.at(table.track_id);
+    const bool stsz_table = table.fourcc == fourcc("stsz") && !constant_sample_size(t);
+    std::vector<unsigned char> in_buf, out_buf;
+
+    for (const auto& s : t.sources) {
+        auto& file = files.at(s.file);
+        bool ok = true;
+        if (stsz_table && s.sample_size) { // a constant size input among varying ones
+            for (uint64_t left = s.sample_count; ok && left; ) {
+                const auto n = std::size_t(std::min(left, table_block_entries));
+                out_buf.resize(n * 4);
+                for (std::size_t i = 0; i < n; ++i) storeBE(out_buf.data() + i * 4, s.sample_size);
+                ok = output.write(out_buf.data(), out_buf.size());
+                left -= n;
+            }
+        }
+        else if (stsz_table) {
+            ok = for_each_block(file, s.stsz_pos, s.sample_count, 4, in_buf, [&](const unsigned char* p, std::size_t n) {
+                return output.write(p, n * 4);
+            });
+        }
+        else if (table.fourcc == fourcc("sdtp")) {
+            ok = for_each_block(file, s.sdtp_pos, s.sdtp_size, 1, in_buf, [&](const unsigned char* p, std::size_t n) {
+                return output.write(p, n);
+            });
+        }
+        else if (table.fourcc == fourcc("stss")) {
+            ok = for_each_block(file, s.stss_pos, s.sync_count, 4, in_buf, [&](const unsigned char* p, std::size_t n) {
+                out_buf.resize(n * 4);
+                for (std::size_t i = 0; i < n; ++i) storeBE(out_buf.data() + i * 4, loadBE<uint32_t>(p + i * 4) + s.sample_offset);
+                return output.write(out_buf.data(), out_buf.size());
+            });
+        }
+        else if (eq_one(table.fourcc, fourcc("stco"), fourcc("co64"))) {
+            ok = for_each_block(file, s.stco_pos, s.chunk_count, s.co64 ? 8 : 4, in_buf, [&](const unsigned char* p, std::size_t n) {
+                out_buf.resize(n * (info.co64 ? 8 : 4));
+                for (std::size_t i = 0; i < n; ++i) {
+                    const auto raw = s.co64 ? loadBE<uint64_t>(p + i * 8) : loadBE<uint32_t>(p + i * 4);
+                    const uint64_t offset = merged_chunk_offset(info, s, raw) + info.mdat_final_position;
+                    if (info.co64) storeBE(out_buf.data() + i * 8, offset);
+                    else           storeBE(out_buf.data() + i * 4, uint32_t(offset));
+                }
+                return output.write(out_buf.data(), out_buf.size());
+            });
+        }
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// Write the moov planned by plan_layout(), streaming in the tables it left out, if any.
+bool
+write_moov(const MergeInfo& info, std::vector<Mp4Stream>& files, const JoinLayout& layout, BinaryStream& output)
+{
+    uint64_t done = 0;
+    // Tables can be back to back, or right at the end. Some streams refuse empty writes.
+    const auto write_up_to = [&](uint64_t end) {
+        return end == done || output.write(layout.moov.data() + done, std::size_t(end - done));
+    };
+    for (const auto& table : info.streamed_tables) {
+        if (!write_up_to(table.position) || !stream_table(info, files, table, output)) return false;
+        done = table.position;
+    }
+    return write_up_to(layout.moov.size());
+}
+
+// Write the joined file as planned by plan_layout(). Only ever appends to the output.
+bool
+write_joined(MergeInfo& info, std::vector<Mp4Stream>& files, const JoinLayout& layout, BinaryStream& output, const JoinOptions& options, Progress& progress,
+             const JoinResources& res)
+{
+    // We don't do additional checking here...
+    if (files.size() < 2) return false;
+    auto& ref = files.front();
+
+    for (const auto& atom : layout.root_atoms)
+    {
+        if(atom.fourcc == fourcc("mdat") && options.fragmented) {
+            const PhaseScope phase(res.stats, IoStats::Mdat);
+            if (!write_fragments(info, files, output, progress, res)) return false;
+        }
+        else if(atom.fourcc == fourcc("mdat")) {
+            const PhaseScope phase(res.stats, IoStats::Mdat);
+            if (!output.writeNum(uint32_t(1)) || !output.writeNum(fourcc("mdat")) || !output.writeNum(layout.mdat_size)) return false;
+
+            if (!copy_mdat(info, files, output, options, progress, res)) return false;
+        }
+        else if(atom.fourcc == fourcc("moov")) {
+            const PhaseScope phase(res.stats, IoStats::Moov);
+            progress.phase(Progress::Phase::Moov);
+            if(progress.cancelled() || !write_moov(info, files, layout, output)) return false;
+        }
+        else {  // Opaque boxes, just copy through.
+            const PhaseScope phase(res.stats, IoStats::Mdat);
+            const PooledBuffer buf(res.pool, res.bufsize);
+            ref.seek(atom.offset);
+            if(!buf || !output.copyFrom(ref, atom.size, buf.data(), buf.size())) return false;
+        }
+    }
+
+    return true;
+}
+
+// Adapts a user-supplied OutputStream to the writers above. Like a pipe, it can't seek.
+class OutputStreamAdapter : public BinaryStream {
+public:
+    explicit OutputStreamAdapter(OutputStream& sink) noexcept : sink(sink) {}
 
+    void setIoStats(IoStats* s) noexcept { stats = s; }
+
+    virtual bool isOpen() const noexcept override { return true; }
+    virtual bool read(void*, std::size_t) noexcept override { return false; }
+    virtual bool write(const void* buf, std::size_t n) noexcept override {
+        const auto start = stats ? IoStats::Clock::now() : IoStats::Clock::time_point{};
+        if (!sink.write(buf, n)) return false;
+        if (stats) stats->write(n, start);
+        return true;
+    }
+    virtual bool seek(OffsetType, SeekFrom) noexcept override { return false; }
+    virtual OffsetType tell() const noexcept override { return -1; }
+
+private:
+    OutputStream& sink;
+    IoStats* stats = nullptr;
+};
+
+// Passes everything written on to `out`, and keeps the CRC-32C of it (JoinOptions::crc32c).
+// Can't seek, as anything rewritten would throw the checksum off.
+class ChecksumStream : public BinaryStream {
+public:
+    explicit ChecksumStream(BinaryStream& out) noexcept : out(out) {}
+
+    uint32_t checksum() const noexcept { return crc; }
+
+    virtual bool isOpen() const noexcept override { return out.isOpen(); }
+    virtual bool read(void*, std::size_t) noexcept override { return false; }
+    virtual bool write(const void* buf, std::size_t n) noexcept override {
+        if (!out.write(buf, n)) return false;
+        crc = crc32c(crc, buf, n);
+        return true;
+    }
+    virtual bool seek(OffsetType, SeekFrom) noexcept override { return false; }
+    virtual OffsetType tell() const noexcept override { return out.tell(); }
+
+private:
+    BinaryStream& out;
+    uint32_t crc = 0;
+};
+
+// `res`, with the copy buffer pool and size filled in where the caller left them open.
+// Buffers come from `own_pool` then, and are sized for `output`.
+JoinResources
+copy_resources(JoinResources res, BufferPool& own_pool, const BinaryStream& output) noexcept
+{
+    if (!res.pool) res.pool = &own_pool;
+    if (!res.bufsize) {
+        const auto* const file = dynamic_cast<const BinaryFileStream*>(&output);
+        res.bufsize = file ? file->preferredBufferSize() : 4*1024*1024;
+    }
+    return res;
+}
+
+// Heap memory held by the sample tables of `info`, for JoinStats::peak_table_bytes.
+uint64_t
+table_bytes(const MergeInfo& info)
+{
+    uint64_t n = 0;
+    for (const auto& t : info.trak_infos) {
+        n += (t.stts.capacity() + t.ctts.capacity()) * sizeof(t.stts[0]) + t.stsz.memoryUsage() + t.stco.memoryUsage() + t.stss.capacity() * sizeof(t.stss[0])
+           + t.sdtp.capacity() + t.stsc.capacity() * sizeof(t.stsc[0]) + t.stsd.capacity() + t.sources.capacity() * sizeof(t.sources[0]);
+    }
+    return n;
+}
+
+// Memory the large tables under `boxes` would take once merged, and once more in the serialized moov.
+// Taken from the box sizes in the index, so that it's known before anything is scanned.
+uint64_t
+table_memory(const std::vector<Mp4Stream::Box>& boxes)
+{
+    uint64_t n = 0;
+    for (const auto& box : boxes) {
+        const auto& a = box.atom;
+        const uint64_t header = a.fourcc == fourcc("stsz") ? 12 : a.fourcc == fourcc("sdtp") ? 4 : 8; // ahead of the entries
+        const auto entries = a.dataSize() > header ? a.dataSize() - header : 0;
+        if (eq_one(a.fourcc, fourcc("stsz"), fourcc("stss"), fourcc("sdtp"))) n += 2 * entries;
+        else if (eq_one(a.fourcc, fourcc("stco"), fourcc("co64"))) n += entries;
+        n += table_memory(box.children);
+    }
+    return n;
+}
+
+// Verify and scan the opened inputs, then merge their tables into `info`.
+// If they would take more than `table_memory_limit` (unless 0), the large tables are left in the inputs; see TableSource.
 JoinResult
-mp4join::mp4_join(int nb_input, const char* const* input_files, const char* output_file, const JoinProgCb& prog_cb) noexcept
+merge_inputs(std::vector<Mp4Stream>& input_streams, bool reference, uint64_t table_memory_limit, unsigned max_threads, IoStats* stats,
+             MergeInfo& info) noexcept
 {
-    if (nb_input < 2) return JoinResult::InvalidInput; // Require at-least 2 input files.
+    const auto nb_input = input_streams.size();
 
-    // Open all input files for read.
-    std::vector<Mp4Stream> input_streams(nb_input);
-    for (auto i = 0; i < nb_input; ++i) {
-        if (!input_streams[i].open(input_files[i])) return JoinResult::IoError;
+    // Verify the inputs in parallel. This indexes them too.
+    {
+        const PhaseScope phase(stats, IoStats::Validate);
+        std::vector<char> valid(nb_input);
+        parallel_for(nb_input, max_threads, [&](std::size_t i) { valid[i] = check_input(input_streams[i]); });
+        if (std::find(valid.begin(), valid.end(), false) != valid.end()) return JoinResult::InvalidInput;
     }
-    // Verify input files.
-    for (auto& file : input_streams) {
-        if(!check_input(file)) return JoinResult::InvalidInput;
-        file.seek(0);
+    uint64_t tables = 0;
+    if (table_memory_limit) for (auto& f : input_streams) tables += table_memory(f.index());
+    const bool streamed = tables > table_memory_limit;
+
+    // Then scan them in parallel, each into a table set of its own.
+    const PhaseScope phase(stats, IoStats::Merge);
+    std::vector<MergeInfo> parts(nb_input);
+    std::vector<char> scanned(nb_input);
+    parallel_for(nb_input, max_threads, [&](std::size_t i) {
+        parts[i].streamed = streamed;
+        scanned[i] = scan_input(input_streams[i], parts[i]);
+    });
+    if (std::find(scanned.begin(), scanned.end(), false) != scanned.end()) return JoinResult::InternalError;
+
+    // And stitch them together, in order. The tables take the most memory while that happens.
+    std::vector<uint64_t> parts_bytes;
+    uint64_t unstitched = 0;
+    if (stats) {
+        for (const auto& part : parts) unstitched += parts_bytes.emplace_back(table_bytes(part));
+        stats->tables(unstitched);
+    }
+    for (std::size_t i = 0; i < nb_input; ++i) {
+        if (!stitch(info, parts[i], reference)) return JoinResult::InternalError;
+        if (stats) {
+            stats->tables(table_bytes(info) + unstitched);
+            unstitched -= parts_bytes[i];
+        }
+        parts[i] = MergeInfo{};
     }
+    return JoinResult::Success;
+}
 
-    if (prog_cb) prog_cb(0);
+// Collects JoinOptions::stats from the inputs of one join, and hands them over when it goes out of scope,
+// however the join ends. The output is up to whoever opens it.
+class StatsCollector {
+public:
+    StatsCollector(JoinStats* out, std::vector<Mp4Stream>& inputs) noexcept : out(out), inputs(inputs) {
+        if (out) for (auto& f : inputs) f.setIoStats(&io);
+    }
+    ~StatsCollector() noexcept {
+        if (!out) return;
+        for (auto& f : inputs) f.setIoStats(nullptr);
+        io.get(*out);
+    }
+
+    StatsCollector(const StatsCollector&) = delete;
+    StatsCollector& operator=(const StatsCollector&) = delete;
+
+    IoStats* get() noexcept { return out ? &io : nullptr; }
+
+private:
+    JoinStats* const out;
+    std::vector<Mp4Stream>& inputs;
+    IoStats io;
+};
+
+// Join the opened inputs. `input_files` names them, it's only needed for reference movies and may be null otherwise.
+// The output is only opened through `open_output(stats)` once everything has been planned,
+// so that nothing gets created for inputs that can't be joined.
+// `stats` must outlive the output, which keeps a pointer to it.
+template <typename OpenOutput>
+JoinResult
+join(std::vector<Mp4Stream>& input_streams, const char* const* input_files, const JoinOptions& options, const JoinProgCb& prog_cb,
+     JoinResources res, StatsCollector& stats, OpenOutput open_output) noexcept
+{
+    const auto nb_input = input_streams.size();
+    res.stats = stats.get();
+    Progress progress(options, prog_cb);
+    progress.phase(Progress::Phase::Scan);
 
+    // Fragments are written from the tables in memory, whatever they take.
+    const auto table_memory_limit = options.fragmented ? 0 : options.table_memory_limit;
     const auto info = std::make_unique<MergeInfo>();
+    if (const auto ret = merge_inputs(input_streams, options.reference, table_memory_limit, res.max_threads, res.stats, *info);
+        ret != JoinResult::Success) return ret;
+    if (options.reference) {
+        if (!input_files) return JoinResult::InvalidInput;
+        for (std::size_t i = 0; i < nb_input; ++i) {
+            info->data_refs.push_back(file_url(input_files[i]));
+            if (info->data_refs.back().empty()) return JoinResult::IoError;
+        }
+    }
 
-    try {
-    for (std::size_t i=0; i<input_streams.size(); ++i) {
-        auto& file = input_streams[i];
-        // Get mdat info
-        // should not throw, since we've checked for mdat.
-        const auto mdat = file.seekToAtomData(fourcc("mdat"), file.getLength());
-        info->mdat_position.push_back({mdat.dataOffset(), mdat.dataSize()});
+    if (progress.cancelled()) return JoinResult::Cancelled;
 
-        // Update info list.
-        file.seek(0);
-        if(!merge_info(*info, file, i, 0, file.getLength())) return JoinResult::InternalError;
+    try {
 
-        // Update offsets for next file.
-        info->mdat_offset += info->mdat_position.at(i)[1];
-        for (auto& t : info->trak_infos) {
-            t.sample_offset = t.stsz_count;
-            t.chunk_offset = (uint32_t)t.stco.size();
+    // Work out the output layout, so that it can be written front to back.
+    const auto layout = std::make_unique<JoinLayout>();
+    {
+        const PhaseScope phase(res.stats, IoStats::Moov);
+        if (options.fragmented) {
+            // The init segment carries no samples, and always comes first.
+            auto init = init_segment_info(*info);
+            if (!plan_layout(init, input_streams, true, *layout) || !append_mvex(init, layout->moov)) return JoinResult::InternalError;
         }
+        else if (!plan_layout(*info, input_streams, options.faststart, *layout)) return JoinResult::InternalError;
+    }
+
+    // Open the output. It doesn't have to be seekable.
+    if (progress.cancelled()) return JoinResult::Cancelled;
+    BinaryStream* const output_stream = open_output(res.stats);
+    if (!output_stream) return JoinResult::IoError;
+    // Write to output.
+    BufferPool own_pool(options.huge_pages);
+    const auto copy_res = copy_resources(res, own_pool, *output_stream);
+    std::optional<ChecksumStream> checksummed;
+    BinaryStream& output = options.crc32c ? checksummed.emplace(*output_stream) : *output_stream;
+    if (!write_joined(*info, input_streams, *layout, output, options, progress, copy_res)) {
+        return progress.cancelled() ? JoinResult::Cancelled : JoinResult::InternalError;
     }
+    if (checksummed) *options.crc32c = checksummed->checksum();
+
+    progress.phase(Progress::Phase::Done);
+
+    }
+    catch (const error&) {
+        return JoinResult::InternalError;
+    }
+
+    return JoinResult::Success;
+}
+
+// Grow a file joined by mp4join in place by the chapter that follows it; see mp4_append().
+// input_streams holds the joined file, then the chapter.
+JoinResult
+append_in_place(std::vector<Mp4Stream>& input_streams, const char* joined_file, const JoinOptions& options, const JoinProgCb& prog_cb) noexcept
+{
+    StatsCollector stats(options.stats, input_streams);
+    Progress progress(options, prog_cb);
+    progress.phase(Progress::Phase::Scan);
 
-    if (prog_cb) prog_cb(1);
+    // The joined file simply counts as the first input.
+    const auto info = std::make_unique<MergeInfo>();
+    if (const auto ret = merge_inputs(input_streams, false, 0, 0, stats.get(), *info); ret != JoinResult::Success) return ret;
+
+    if (progress.cancelled()) return JoinResult::Cancelled;
 
-    // Open the output file.
+    // Once opened, the joined file gets rewritten. Only its old moov is kept, to put it back should the append not finish.
     BinaryFileStream output_stream;
-    if (!output_stream.open(output_file, BinaryFileStream::OpenMode::WRITE)) return JoinResult::IoError;
-    // Write to output file.
-    input_streams.front().seek(0);
-    if (!write_joined(*info, input_streams, output_stream, 0, input_streams.front().getLength(), prog_cb)) return JoinResult::InternalError;
+    Mp4Stream::AtomInfo old_moov_atom{};
+    std::vector<unsigned char> old_moov;
+    int64_t mdat_size_offset = 0; // of the 64-bit mdat size
+    uint64_t old_mdat_size = 0;
+
+    // The old moov goes back where it was, with the old mdat size, and whatever was appended is cut off again.
+    // The mdat size is only updated once everything else is written, so the old file is whole again after this.
+    const auto restore = [&](JoinResult ret) {
+        if (output_stream.seek(int64_t(old_moov_atom.offset)) && output_stream.write(old_moov.data(), old_moov.size())
+            && output_stream.patchNum(mdat_size_offset, old_mdat_size) && output_stream.close()) {
+            std::error_code ec;
+            std::filesystem::resize_file(joined_file, old_moov_atom.endOffset(), ec);
+        }
+        return progress.cancelled() ? JoinResult::Cancelled : ret;
+    };
+
+    try {
+
+    const auto layout = std::make_unique<JoinLayout>();
+    {
+        const PhaseScope phase(stats.get(), IoStats::Moov);
+        if (!plan_layout(*info, input_streams, false, *layout)) return JoinResult::InternalError;
+    }
+
+    // Only mdat followed by moov, at the very end, can be grown in place. The mdat must also have the 64-bit header
+    // write_joined() gives it, i.e. its data stays where it is in the new layout.
+    const auto& atoms = layout->root_atoms;
+    const auto& joined_ranges = info->mdat_ranges.at(0);
+    if (joined_ranges.size() != 1) return JoinResult::InvalidInput;
+    const auto data_offset = joined_ranges[0].offset, data_size = joined_ranges[0].size;
+    if (atoms.size() < 2 || atoms.back().fourcc != fourcc("moov") || atoms[atoms.size() - 2].fourcc != fourcc("mdat")
+        || info->mdat_final_position != data_offset) return JoinResult::InvalidInput;
+
+    // Everything needed from the joined file is in the layout now, from here on it gets rewritten.
+    old_moov_atom = atoms.back();
+    old_moov.resize(std::size_t(old_moov_atom.size));
+    mdat_size_offset = int64_t(data_offset) - 8;
+    old_mdat_size = data_size + 16;
+    auto& joined = input_streams.front();
+    if (progress.cancelled()) return JoinResult::Cancelled;
+    if (!joined.seek(int64_t(old_moov_atom.offset)) || !joined.read(old_moov.data(), old_moov.size())) return JoinResult::IoError;
+    joined.close();
+    if (!output_stream.open(joined_file, BinaryFileStream::OpenMode::UPDATE)) return JoinResult::IoError;
+    output_stream.setIoStats(stats.get());
 
-    // Patch co64
-    for (const auto &track : info->trak_infos) {
-        output_stream.seek(track.co64_final_position);
-        for (const auto &x : track.stco) {
-            output_stream.writeNum(x + info->mdat_final_position);
+    // The chapter's media data goes where moov was, followed by the new moov.
+    BufferPool own_pool(options.huge_pages);
+    JoinResources res;
+    res.stats = stats.get();
+    {
+        const PhaseScope phase(stats.get(), IoStats::Mdat);
+        if (!output_stream.seek(int64_t(data_offset + data_size))
+            || !copy_mdat(*info, input_streams, output_stream, options, progress, copy_resources(res, own_pool, output_stream), 1)) {
+            return restore(JoinResult::InternalError);
         }
     }
+    const PhaseScope phase(stats.get(), IoStats::Moov);
+    progress.phase(Progress::Phase::Moov);
+    if (progress.cancelled() || !output_stream.write(layout->moov.data(), layout->moov.size())) return restore(JoinResult::InternalError);
+    if (!output_stream.patchNum(mdat_size_offset, layout->mdat_size)) return restore(JoinResult::InternalError);
+
+    // Cut the file right after the new moov, in case it ends short of where the old one did.
+    // The mdat box starts with its 16 byte header, right before the joined file's data.
+    if (!output_stream.close()) return JoinResult::IoError;
+    std::error_code ec;
+    std::filesystem::resize_file(joined_file, data_offset - 16 + layout->mdat_size + layout->moov.size(), ec);
+    if (ec) return JoinResult::IoError;
 
-    if (prog_cb) prog_cb(100);
+    progress.phase(Progress::Phase::Done);
 
     }
     catch (const error&) {
-        return JoinResult::InternalError;
+        return output_stream.isOpen() ? restore(JoinResult::InternalError) : JoinResult::InternalError;
     }
 
     return JoinResult::Success;
 }
+
+} // unnamed ns
+
+JoinResult
+mp4join::mp4_join(int nb_input, const char* const* input_files, const char* output_file, const JoinProgCb& prog_cb) noexcept
+{
+    return mp4_join(nb_input, input_files, output_file, JoinOptions{}, prog_cb);
+}
+
+JoinResult
+mp4join::mp4_join(int nb_input, const char* const* input_files, const char* output_file, const JoinOptions& options, const JoinProgCb& prog_cb) noexcept
+{
+    return join_files(nb_input, input_files, output_file, options, prog_cb, JoinResources{});
+}
+
+JoinResult
+mp4join::join_files(int nb_input, const char* const* input_files, const char* output_file, const JoinOptions& options,
+                    const JoinProgCb& prog_cb, const JoinResources& resources) noexcept
+{
+    if (nb_input < 2) return JoinResult::InvalidInput; // Require at-least 2 input files.
+    if (options.reference && nb_input > UINT16_MAX) return JoinResult::InvalidInput; // data_reference_index is 16 bits
+    if (options.reference && options.fragmented) return JoinResult::InvalidInput;
+
+    // Open all input files for read.
+    std::vector<Mp4Stream> input_streams(nb_input);
+    for (auto i = 0; i < nb_input; ++i) {
+        if (!input_streams[i].open(input_files[i])) return JoinResult::IoError;
+    }
+
+    StatsCollector stats(options.stats, input_streams);
+    BinaryFileStream output_stream;
+    const auto ret = join(input_streams, input_files, options, prog_cb, resources, stats, [&](IoStats* io_stats) -> BinaryStream* {
+        if (!output_stream.open(output_file, BinaryFileStream::OpenMode::WRITE)) return nullptr;
+        output_stream.setIoStats(io_stats);
+        return &output_stream;
+    });
+
+    // Don't leave a partial output behind. Only plain files are removed, not e.g. /dev/stdout.
+    if (ret == JoinResult::Cancelled && output_stream.isOpen()) {
+        output_stream.close();
+        std::error_code ec;
+        if (std::filesystem::symlink_status(output_file, ec).type() == std::filesystem::file_type::regular) {
+            std::filesystem::remove(output_file, ec);
+        }
+    }
+    return ret;
+}
+
+JoinResult
+mp4join::mp4_join(int nb_input, InputStream* const* inputs, OutputStream& output, const JoinOptions& options, const JoinProgCb& prog_cb) noexcept
+{
+    if (nb_input < 2) return JoinResult::InvalidInput;
+    if (options.reference) return JoinResult::InvalidInput; // there are no files to refer to
+
+    std::vector<Mp4Stream> input_streams(nb_input);
+    for (auto i = 0; i < nb_input; ++i) {
+        if (!inputs[i] || !input_streams[i].open(*inputs[i])) return JoinResult::IoError;
+    }
+
+    StatsCollector stats(options.stats, input_streams);
+    OutputStreamAdapter output_stream(output);
+    return join(input_streams, nullptr, options, prog_cb, JoinResources{}, stats, [&](IoStats* io_stats) -> BinaryStream* {
+        output_stream.setIoStats(io_stats);
+        return &output_stream;
+    });
+}
+
+JoinResult
+mp4join::mp4_append(const char* joined_file, const char* chapter_file, const JoinOptions& options, const JoinProgCb& prog_cb) noexcept
+{
+    if (options.faststart || options.reference || options.fragmented) return JoinResult::InvalidInput;
+
+    std::vector<Mp4Stream> input_streams(2);
+    if (!input_streams[0].open(joined_file) || !input_streams[1].open(chapter_file)) return JoinResult::IoError;
+
+    return append_in_place(input_streams, joined_file, options, prog_cb);
+}
@@ -0,0 +1,107 @@
+#ifndef IO_HPP_5C2A7E94_1D3B_4F60_8E2A_9B7D4C1F3E85
+#define IO_HPP_5C2A7E94_1D3B_4F60_8E2A_9B7D4C1F3E85
+
+#include "api_export.h"
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace mp4join {
+
+/**
+ * Source of one input, for joining data that isn't in a file of its own.
+ *
+ * Reads go through a current position, like a file. The inputs are scanned in parallel,
+ * so different InputStreams may be used from different threads at the same time,
+ * though each one is only ever used by one thread at a time.
+ */
+class MP4JOIN_API InputStream {
+public:
+    using OffsetType = std::int64_t;
+
+    virtual ~InputStream() noexcept = default;
+
+    virtual OffsetType size() const noexcept = 0;             // Total length in bytes.
+    virtual bool read(void* buf, std::size_t n) noexcept = 0; // Read exactly n bytes at the current position, and advance past them.
+    virtual bool seek(OffsetType offset) noexcept = 0;        // Move the current position, counted from the start.
+    virtual OffsetType tell() const noexcept = 0;
+
+    // The whole input as one block of memory, if it is one. Sample tables are then parsed in place.
+    virtual const unsigned char* data() const noexcept { return nullptr; }
+};
+
+/**
+ * Sink for the joined file. It is written strictly front to back, and never seeked.
+ */
+class MP4JOIN_API OutputStream {
+public:
+    virtual ~OutputStream() noexcept = default;
+
+    virtual bool write(const void* buf, std::size_t n) noexcept = 0; // Write all n bytes.
+};
+
+
+// Input held in memory. The memory must stay valid until the join returns.
+class MP4JOIN_API MemoryInput : public InputStream {
+public:
+    MemoryInput(const void* data, std::size_t size) noexcept;
+
+    virtual OffsetType size() const noexcept override;
+    virtual bool read(void* buf, std::size_t n) noexcept override;
+    virtual bool seek(OffsetType offset) noexcept override;
+    virtual OffsetType tell() const noexcept override;
+    virtual const unsigned char* data() const noexcept override;
+
+private:
+    const unsigned char* ptr;
+    std::size_t len;
+    std::size_t pos = 0;
+};
+
+// Input read through a callback, which reads exactly n bytes at `offset` into `buf` and returns false on failure.
+class MP4JOIN_API CallbackInput : public InputStream {
+public:
+    using ReadFn = std::function<bool(void* buf, std::size_t n, OffsetType offset)>;
+
+    CallbackInput(OffsetType size, ReadFn read_fn) noexcept;
+
+    virtual OffsetType size() const noexcept override;
+    virtual bool read(void* buf, std::size_t n) noexcept override;
+    virtual bool seek(OffsetType offset) noexcept override;
+    virtual OffsetType tell() const noexcept override;
+
+private:
+    ReadFn fn;
+    OffsetType len;
+    OffsetType pos = 0;
+};
+
+// Output appended to a byte vector.
+class MP4JOIN_API MemoryOutput : public OutputStream {
+public:
+    explicit MemoryOutput(std::vector<unsigned char>& buf) noexcept;
+
+    virtual bool write(const void* buf, std::size_t n) noexcept override;
+
+private:
+    std::vector<unsigned char>& dest;
+};
+
+// Output passed on to a callback, which writes all n bytes of `buf` and returns false on failure.
+class MP4JOIN_API CallbackOutput : public OutputStream {
+public:
+    using WriteFn = std::function<bool(const void* buf, std::size_t n)>;
+
+    explicit CallbackOutput(WriteFn write_fn) noexcept;
+
+    virtual bool write(const void* buf, std::size_t n) noexcept override;
+
+private:
+    WriteFn fn;
+};
+
+}
+
+
+#endif /* IO_HPP_5C2A7E94_1D3B_4F60_8E2A_9B7D4C1F3E85 */
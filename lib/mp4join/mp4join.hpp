@@ -2,7 +2,14 @@
 #define MP4JOIN_HPP_B1D75A8F_49D2_4E94_8559_C4EC6A2836E9
 
 #include "api_export.h"
+#include "io.hpp"
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace mp4join {
 
@@ -10,11 +17,79 @@ enum class JoinResult {
     Success = 0,
     InvalidInput,
     IoError,
-    InternalError
+    InternalError,
+    Cancelled       // See JoinOptions::cancel.
 };
 
 using JoinProgCb = std::function<void(int prog)>;
 
+// Where a join is at. See JoinOptions::progress.
+struct JoinProgress {
+    enum class Phase { Scan, Moov, Mdat, Done };
+
+    Phase phase = Phase::Scan;     // Scan: indexing, checking and merging the inputs. Moov: writing the merged moov.
+                                   // Mdat: copying the media data. Moov may come before or after Mdat.
+    int percent = 0;               // Same as passed to JoinProgCb.
+    std::uint64_t bytes_done = 0;  // Media data copied so far.
+    std::uint64_t bytes_total = 0; // Media data to copy in all. Known once the copy starts.
+    double bytes_per_second = 0;   // Average copy rate since the copy started.
+};
+
+using JoinProgressCb = std::function<void(const JoinProgress& progress)>;
+
+// Where a join spent its time, for telling what made a slow one slow. See JoinOptions::stats.
+struct JoinStats {
+    struct PhaseStats {
+        double wall_seconds = 0;
+        double cpu_seconds = 0;           // CPU time of the whole process while the phase ran, other threads and joins included.
+        std::uint64_t bytes_read = 0;     // Including what is read in place from memory-mapped (or in-memory) inputs, without read calls.
+        std::uint64_t bytes_written = 0;
+        std::uint64_t reads = 0;          // Read calls on files and InputStreams, and io_uring read requests.
+        std::uint64_t writes = 0;         // Write calls on files and the OutputStream, and io_uring write requests.
+        std::uint64_t copies = 0;         // In-kernel copies (copy_file_range, sendfile, reflinks). Their bytes count as read and as written.
+        std::uint64_t seeks = 0;          // Seeks on files and InputStreams, memory-mapped inputs aside.
+        // Reads, writes and copies by how long they took: [0] under 1 µs, [i] from 2^(i-1) µs to under 2^i µs,
+        // and the last one anything longer.
+        std::array<std::uint64_t, 24> latency{};
+    };
+
+    PhaseStats validate;  // Indexing and checking the inputs.
+    PhaseStats merge;     // Scanning the sample tables of the inputs, and merging them.
+    PhaseStats moov;      // Serializing the merged moov, and writing it out.
+    PhaseStats mdat;      // Copying the media data (or writing fragments), and any other boxes passed through.
+    std::uint64_t peak_table_bytes = 0; // Most memory the sample tables took at any one time while merging.
+};
+
+struct JoinOptions {
+    bool faststart = false; // Place moov before mdat ("fast start"), regardless of the box order in the inputs.
+    bool io_uring = false;  // Linux: copy the media data the kernel can't move by itself through io_uring, with many requests in flight.
+                            // Silently falls back to the threaded read/write copy if io_uring is unavailable.
+    bool bypass_page_cache = false; // Write back and evict media data from the page cache as it is copied, on both the input and
+                                    // the output side, so that huge joins don't push everything else out of memory.
+    bool reference = false; // Write a reference movie: only the merged moov, whose data references point at the input files by
+                            // absolute file:// URL. No media data is copied, so the inputs must stay where they are.
+    bool fragmented = false; // Write fragmented MP4: an init segment, then moof/mdat fragments cut at sync samples.
+                             // The moov no longer grows with the recording length. Can't be combined with `reference`.
+                             // The media data is rearranged by track within each fragment, so `io_uring` and
+                             // `bypass_page_cache` don't apply.
+    bool huge_pages = false; // Linux: ask for transparent huge pages behind the copy buffers, for fewer page faults and TLB misses.
+    std::size_t table_memory_limit = 0; // Most memory (in bytes) the merged sample tables may take; 0 for no limit. Joins that need
+                                        // more leave sample sizes, chunk offsets and sync samples in the inputs, and stream them
+                                        // into the output moov while it is written. Ignored by `fragmented` and mp4_append().
+    JoinStats* stats = nullptr; // (Optional) filled in once the join is over, successful or not. Counting costs a clock read
+                                // per I/O call. Each concurrent join needs one of its own.
+    std::uint32_t* crc32c = nullptr; // (Optional) set to the CRC-32C of the whole output once the join succeeds, computed from
+                                     // the bytes as they are written. The media data has to pass through memory for that, so
+                                     // the kernel copy, `io_uring` and `bypass_page_cache` are off then. Ignored by mp4_append().
+    JoinProgressCb progress;    // (Optional) called from the thread running the join at every phase change, and in between
+                                // at most once every `progress_interval_ms`.
+    unsigned progress_interval_ms = 250;
+    const std::atomic<bool>* cancel = nullptr; // (Optional) setting it, from any thread, makes the join stop at the next copy
+                                               // buffer (or phase) boundary and return JoinResult::Cancelled. A partially
+                                               // written output file is removed; what was written to an OutputStream is
+                                               // left to the caller. mp4_append() puts the joined file back as it was.
+};
+
 /**
  * Join consecutive mp4 files into one.
  *
@@ -28,6 +103,88 @@ using JoinProgCb = std::function<void(int prog)>;
  */
 MP4JOIN_API JoinResult mp4_join(int nb_input, const char* const* input_files, const char* output_file, const JoinProgCb& prog_cb = {}) noexcept;
 
+/**
+ * Same as above, with additional output options.
+ *
+ * @param[in] options     See JoinOptions.
+ */
+MP4JOIN_API JoinResult mp4_join(int nb_input, const char* const* input_files, const char* output_file, const JoinOptions& options, const JoinProgCb& prog_cb = {}) noexcept;
+
+/**
+ * Same as above, reading from and writing to user-supplied streams instead of files (see io.hpp).
+ *
+ * @param[in] inputs      Array of input streams, of length `nb_input`. They must outlive the call.
+ * @param[in] output      Output stream.
+ *
+ * @note Reference movies (JoinOptions::reference) need input files, and are rejected here.
+ */
+MP4JOIN_API JoinResult mp4_join(int nb_input, InputStream* const* inputs, OutputStream& output, const JoinOptions& options = {}, const JoinProgCb& prog_cb = {}) noexcept;
+
+/**
+ * Append the next chapter to a file joined by mp4_join(), in place.
+ *
+ * Only the chapter's media data is copied, to where moov used to be, at the end of the existing media data.
+ * The merged moov is rewritten after it. The joined file isn't playable while this runs.
+ * If the append fails or is cancelled midway, the joined file is put back as it was, as far as it can be.
+ *
+ * @param[in] joined_file  File joined by mp4_join(), without `faststart`, `reference` or `fragmented`.
+ * @param[in] chapter_file The chapter to append.
+ * @param[in] options      Only `io_uring`, `bypass_page_cache`, `huge_pages`, `stats`, `progress` and `cancel` apply. `faststart`, `reference` and
+ *                         `fragmented` are errors.
+ * @param[in] prog_cb      Same as for mp4_join().
+ *
+ * @return JoinResult::InvalidInput if `joined_file` doesn't have mdat followed by moov at the end,
+ *         as written by mp4_join().
+ */
+MP4JOIN_API JoinResult mp4_append(const char* joined_file, const char* chapter_file, const JoinOptions& options = {}, const JoinProgCb& prog_cb = {}) noexcept;
+
+// One join to be run by a JoinSession, i.e. the arguments of mp4_join().
+struct JoinJob {
+    std::vector<std::string> input_files;
+    std::string output_file;
+    JoinOptions options;
+    JoinProgCb prog_cb;      // Called from the worker thread running the job.
+};
+
+using JoinDoneCb = std::function<void(const JoinJob& job, JoinResult result)>;
+
+struct SessionOptions {
+    unsigned max_jobs = 0;            // Jobs running at once; 0 for one per hardware thread.
+    unsigned max_jobs_per_device = 2; // Jobs running at once that read from or write to the same storage device.
+};
+
+/**
+ * Runs many joins on a shared set of worker threads.
+ *
+ * Jobs start in the order they were submitted, except that a job waits while any storage device it uses
+ * already has SessionOptions::max_jobs_per_device jobs running, letting later jobs on other devices go first.
+ * Copy buffers are shared by all workers, and kept from one job to the next. Each worker scans the inputs of a job by itself.
+ */
+class MP4JOIN_API JoinSession {
+public:
+    explicit JoinSession(const SessionOptions& options = {}) noexcept;
+    ~JoinSession() noexcept; // Waits for all submitted jobs.
+
+    JoinSession(const JoinSession&) = delete;
+    JoinSession& operator=(const JoinSession&) = delete;
+
+    /**
+     * Queue a job, and return right away.
+     *
+     * @param[in] done_cb (Optional) called from the worker thread once the job is finished.
+     *
+     * @return false if the job couldn't be queued.
+     */
+    bool submit(JoinJob job, JoinDoneCb done_cb = {}) noexcept;
+
+    // Block until every job submitted so far is finished.
+    void wait() noexcept;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
 }
 
 
@@ -0,0 +1,160 @@
+#ifndef SAMPLE_TABLES_HPP_9E41C7B2_5A0D_4F3E_B8C6_2D7F10A4E93B
+#define SAMPLE_TABLES_HPP_9E41C7B2_5A0D_4F3E_B8C6_2D7F10A4E93B
+
+#include "byte_order.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// Compact in-memory forms of the sample tables, as merged across inputs.
+// They only ever grow at the end, which is all merging needs.
+
+namespace mp4join {
+
+// Sample sizes (stsz). Kept as a single constant for as long as all samples have the same size.
+class SampleSizes {
+public:
+    std::uint32_t count() const noexcept { return n; }
+    // Size shared by all samples, or 0 if they differ.
+    std::uint32_t constantSize() const noexcept { return constant; }
+    // Per-sample sizes, empty while constantSize() is set.
+    const std::vector<std::uint32_t>& table() const noexcept { return sizes; }
+    // Heap memory held, in bytes.
+    std::size_t memoryUsage() const noexcept { return sizes.capacity() * sizeof(std::uint32_t); }
+
+    std::uint32_t operator[](std::size_t i) const noexcept { return constant ? constant : sizes[i]; }
+
+    // Append `count` samples of `size` bytes each.
+    void appendConstant(std::uint32_t size, std::uint32_t count) {
+        if (count == 0) return;
+        if (size != 0 && (n == 0 || constant == size)) {
+            constant = size;
+            n += count;
+            return;
+        }
+        expand();
+        sizes.insert(sizes.end(), count, size);
+        n += count;
+    }
+
+    // Append a table of `count` big-endian 32-bit sizes.
+    void appendTable(const unsigned char* src, std::uint32_t count) {
+        if (count == 0) return;
+        const auto first = n == 0 ? loadBE<std::uint32_t>(src) : constant;
+        if (first != 0 && (n == 0 || constant)) {
+            std::uint32_t i = 0;
+            while (i < count && loadBE<std::uint32_t>(src + std::size_t(i) * 4) == first) ++i;
+            if (i == count) return appendConstant(first, count);
+        }
+        expand();
+        const auto base = sizes.size();
+        sizes.resize(base + count);
+        std::uint32_t* const out = sizes.data() + base;
+        for (std::uint32_t i = 0; i < count; ++i) {
+            out[i] = loadBE<std::uint32_t>(src + std::size_t(i) * 4);
+        }
+        n += count;
+    }
+
+    void append(const SampleSizes& other) {
+        if (other.n == 0) return;
+        if (other.constant) return appendConstant(other.constant, other.n);
+        expand();
+        sizes.insert(sizes.end(), other.sizes.begin(), other.sizes.end());
+        n += other.n;
+    }
+
+private:
+    // Switch to the per-sample form.
+    void expand() {
+        if (!constant) return;
+        sizes.assign(n, constant);
+        constant = 0;
+    }
+
+    std::uint32_t constant = 0;
+    std::uint32_t n = 0;
+    std::vector<std::uint32_t> sizes;
+};
+
+// Chunk offsets (stco/co64), stored as their low 32 bits, plus one entry for each run of chunks
+// sharing the same high 32 bits. Real files only cross a 4 GiB boundary a handful of times,
+// so this takes about half the memory of plain 64-bit offsets.
+class ChunkOffsets {
+public:
+    std::size_t size() const noexcept { return low.size(); }
+    bool empty() const noexcept { return low.empty(); }
+    std::uint64_t max() const noexcept { return maximum; }
+    // Heap memory held, in bytes.
+    std::size_t memoryUsage() const noexcept { return low.capacity() * sizeof(std::uint32_t) + segs.capacity() * sizeof(Segment); }
+
+    std::uint64_t operator[](std::size_t i) const noexcept {
+        // The last segment starting at or before i.
+        const auto seg = std::upper_bound(segs.begin(), segs.end(), i, [](std::size_t i, const Segment& s) { return i < s.first; }) - 1;
+        return seg->high | low[i];
+    }
+
+    void push_back(std::uint64_t offset) {
+        const auto high = offset & ~std::uint64_t(UINT32_MAX);
+        if (segs.empty() || segs.back().high != high) segs.push_back({low.size(), high});
+        low.push_back(std::uint32_t(offset));
+        maximum = std::max(maximum, offset);
+    }
+
+    // Append all of `other`, adding `shift` to every offset.
+    void append(const ChunkOffsets& other, std::uint64_t shift) {
+        low.reserve(low.size() + other.size());
+        other.forEach([&](std::uint64_t offset) { push_back(offset + shift); });
+    }
+
+    // Call fn(offset) for every offset, in order.
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        for (std::size_t s = 0; s < segs.size(); ++s) {
+            const auto end = s + 1 < segs.size() ? segs[s + 1].first : low.size();
+            for (auto i = segs[s].first; i < end; ++i) fn(segs[s].high | low[i]);
+        }
+    }
+
+private:
+    struct Segment {
+        std::size_t first;  // index of the first chunk in the segment
+        std::uint64_t high; // high 32 bits shared by its offsets
+    };
+    std::vector<std::uint32_t> low;
+    std::vector<Segment> segs;
+    std::uint64_t maximum = 0;
+};
+
+// Run-length tables (stts, stsc) keep a new entry only where a run actually changes.
+// Collapse the entries from `from` on into the ones before them, where they just continue the same run.
+
+// stts: sample count, sample duration
+inline void
+compact_stts(std::vector<std::array<std::uint32_t, 2>>& stts, std::size_t from)
+{
+    if (from >= stts.size()) return;
+    auto out = from == 0 ? std::size_t(1) : from;
+    for (auto i = out; i < stts.size(); ++i) {
+        if (stts[i][1] == stts[out - 1][1]) stts[out - 1][0] += stts[i][0];
+        else stts[out++] = stts[i];
+    }
+    stts.resize(out);
+}
+
+// stsc: first chunk, samples per chunk, sample description index
+inline void
+compact_stsc(std::vector<std::array<std::uint32_t, 3>>& stsc, std::size_t from)
+{
+    if (from >= stsc.size()) return;
+    auto out = from == 0 ? std::size_t(1) : from;
+    for (auto i = out; i < stsc.size(); ++i) {
+        if (stsc[i][1] != stsc[out - 1][1] || stsc[i][2] != stsc[out - 1][2]) stsc[out++] = stsc[i];
+    }
+    stsc.resize(out);
+}
+
+}
+
+#endif /* SAMPLE_TABLES_HPP_9E41C7B2_5A0D_4F3E_B8C6_2D7F10A4E93B */
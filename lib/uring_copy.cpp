@@ -0,0 +1,269 @@
+#include "uring_copy.hpp"
+#include "io_stats.hpp"
+
+#ifndef MP4JOIN_HAVE_IO_URING
+
+RingCopyResult uring_copy(BinaryFileStream&, const std::vector<CopyExtent>&, std::size_t, unsigned,
+                          const std::function<bool(std::size_t)>&) noexcept
+{
+    return RingCopyResult::Unavailable;
+}
+
+#else
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+
+// Minimal raw-syscall io_uring, just what the copy needs.
+class Uring {
+public:
+    ~Uring() noexcept {
+        if (sqes) munmap(sqes, sqes_size);
+        if (cq_ptr && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        if (sq_ptr) munmap(sq_ptr, sq_size);
+        if (fd >= 0) close(fd);
+    }
+
+    bool init(unsigned entries) noexcept {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        fd = int(syscall(__NR_io_uring_setup, entries, &p));
+        if (fd < 0) return false;
+
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap && cq_size > sq_size) sq_size = cq_size;
+
+        sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+        if (!sq_ptr) return false;
+        cq_ptr = single_mmap ? sq_ptr : map(cq_size, IORING_OFF_CQ_RING);
+        if (!cq_ptr) return false;
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(map(sqes_size, IORING_OFF_SQES));
+        if (!sqes) return false;
+
+        const auto sq = static_cast<char*>(sq_ptr);
+        sq_head  = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sq_tail  = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask  = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        sq_entries = p.sq_entries;
+        const auto cq = static_cast<char*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes    = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    bool registerBuffers(const iovec* iov, unsigned n) noexcept {
+        return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, n) == 0;
+    }
+
+    // Queue a fixed-buffer read or write. The caller keeps the number in flight within the ring size.
+    void prep(std::uint8_t op, int file_fd, unsigned buf_index, void* addr, std::size_t len, std::uint64_t offset, std::uint64_t user_data) noexcept {
+        const unsigned tail = local_tail++;
+        io_uring_sqe& sqe = sqes[tail & sq_mask];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = op;
+        sqe.fd = file_fd;
+        sqe.addr = reinterpret_cast<std::uint64_t>(addr);
+        sqe.len = unsigned(len);
+        sqe.off = offset;
+        sqe.buf_index = std::uint16_t(buf_index);
+        sqe.user_data = user_data;
+        sq_array[tail & sq_mask] = tail & sq_mask;
+        ++to_submit;
+    }
+
+    // Submit everything queued, and wait for at least one completion.
+    // A temporary shortage (EAGAIN, or EBUSY while completions are pending) returns true too, for the caller to reap and retry.
+    // False means the ring itself is unusable.
+    bool submitAndWait() noexcept {
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        for (;;) {
+            const auto ret = syscall(__NR_io_uring_enter, fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret >= 0) {
+                to_submit -= unsigned(ret);
+                return true;
+            }
+            if (errno == EAGAIN || errno == EBUSY) return true;
+            if (errno != EINTR) return false;
+        }
+    }
+
+    // Pop the next completion, if any.
+    bool reap(io_uring_cqe& out) noexcept {
+        const unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+        out = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    unsigned entries() const noexcept { return sq_entries; }
+
+private:
+    void* map(std::size_t size, off_t offset) noexcept {
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    int fd = -1;
+    void* sq_ptr = nullptr;
+    void* cq_ptr = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    std::size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr;
+    unsigned sq_mask = 0, sq_entries = 0;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+    unsigned local_tail = 0;
+    unsigned to_submit = 0;
+};
+
+struct Buffers {
+    explicit Buffers(std::size_t n) noexcept : size(n) {
+        void* const m = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        p = m == MAP_FAILED ? nullptr : static_cast<unsigned char*>(m);
+    }
+    ~Buffers() noexcept { if (p) munmap(p, size); }
+
+    unsigned char* p;
+    std::size_t size;
+};
+
+// One chunk of the copy, always bound to the registered buffer of the same index while in flight.
+struct Chunk {
+    int src_fd;
+    std::uint64_t src_off;
+    std::uint64_t dst_off;
+    std::size_t len;
+    std::size_t done;    // bytes of the current stage (read or write) completed
+    bool writing;
+    IoStats::Clock::time_point submitted; // of the request in flight, for IoStats
+};
+
+}
+
+RingCopyResult uring_copy(BinaryFileStream& dst, const std::vector<CopyExtent>& extents,
+                          std::size_t bufsize, unsigned queue_depth,
+                          const std::function<bool(std::size_t)>& on_written) noexcept
+{
+    if (bufsize == 0 || queue_depth == 0 || bufsize > 0x7FFFF000) return RingCopyResult::Unavailable;
+
+    // Gather the work: every extent must be backed by a file descriptor.
+    struct Source { int fd; std::uint64_t off; std::uint64_t size; };
+    std::vector<Source> sources;
+    for (const auto& e : extents) {
+        const auto f = dynamic_cast<BinaryFileStream*>(e.src);
+        const int fd = f ? f->nativeHandle() : -1;
+        if (fd < 0 || e.offset < 0) return RingCopyResult::Unavailable;
+        sources.push_back({fd, std::uint64_t(e.offset), e.size});
+    }
+    const auto out_start = dst.tell(); // -1 for pipes: completions may arrive out of order, so no
+    const int out_fd = dst.nativeHandle();
+    if (out_start < 0 || out_fd < 0) return RingCopyResult::Unavailable;
+
+    Uring ring;
+    if (!ring.init(queue_depth)) return RingCopyResult::Unavailable;
+    // Each buffer has at most one request in flight, so this many fit in the ring.
+    const unsigned nb_buffers = std::min(queue_depth, ring.entries());
+
+    // Page-aligned buffer memory, registered with the ring once.
+    const Buffers mem(std::size_t(nb_buffers) * bufsize);
+    if (!mem.p) return RingCopyResult::Unavailable;
+    std::vector<iovec> iov(nb_buffers);
+    for (unsigned i = 0; i < nb_buffers; ++i) {
+        iov[i].iov_base = mem.p + std::size_t(i) * bufsize;
+        iov[i].iov_len = bufsize;
+    }
+    if (!ring.registerBuffers(iov.data(), nb_buffers)) return RingCopyResult::Unavailable;
+
+    // From here on, errors are real I/O errors.
+    std::vector<Chunk> slots(nb_buffers);
+    std::vector<unsigned> free_slots;
+    for (unsigned i = nb_buffers; i-- > 0;) free_slots.push_back(i);
+
+    std::size_t src_idx = 0;
+    std::uint64_t src_pos = 0;                   // within sources[src_idx]
+    std::uint64_t dst_pos = std::uint64_t(out_start);
+    unsigned in_flight = 0;
+    bool failed = false; // no more submissions, only waiting for those in flight
+    IoStats* const stats = dst.ioStats();
+
+    const auto submit_stage = [&](unsigned i) {
+        auto& c = slots[i];
+        if (stats) c.submitted = IoStats::Clock::now();
+        const auto base = static_cast<unsigned char*>(iov[i].iov_base);
+        if (c.writing) ring.prep(IORING_OP_WRITE_FIXED, out_fd, i, base + c.done, c.len - c.done, c.dst_off + c.done, i);
+        else           ring.prep(IORING_OP_READ_FIXED,  c.src_fd, i, base + c.done, c.len - c.done, c.src_off + c.done, i);
+        ++in_flight;
+    };
+
+    for (;;) {
+        // Fill every free buffer with the next read.
+        while (!failed && !free_slots.empty() && src_idx < sources.size()) {
+            const auto& src = sources[src_idx];
+            if (src_pos == src.size) {
+                ++src_idx;
+                src_pos = 0;
+                continue;
+            }
+            const auto len = std::size_t(std::min<std::uint64_t>(src.size - src_pos, bufsize));
+            const unsigned i = free_slots.back();
+            free_slots.pop_back();
+            slots[i] = Chunk{src.fd, src.off + src_pos, dst_pos, len, 0, false, {}};
+            src_pos += len;
+            dst_pos += len;
+            submit_stage(i);
+        }
+        if (in_flight == 0) break;
+
+        // Requests still in flight when this returns could write to the output after the caller has moved on,
+        // e.g. put back what they overwrite. So after a failure, it waits for all of them before returning.
+        // Only a broken ring can't be waited on.
+        if (!ring.submitAndWait()) return RingCopyResult::Failed;
+        io_uring_cqe cqe;
+        while (ring.reap(cqe)) {
+            --in_flight;
+            const auto i = unsigned(cqe.user_data);
+            auto& c = slots[i];
+            if (failed) continue;
+            if (cqe.res <= 0) { // error, or unexpected EOF
+                failed = true;
+                continue;
+            }
+            if (stats && c.writing) stats->write(std::size_t(cqe.res), c.submitted);
+            else if (stats) stats->read(std::size_t(cqe.res), c.submitted);
+            c.done += std::size_t(cqe.res);
+            if (c.done < c.len) { // short transfer, resubmit the rest
+                submit_stage(i);
+                continue;
+            }
+            if (!c.writing) {
+                c.writing = true;
+                c.done = 0;
+                submit_stage(i);
+            }
+            else {
+                free_slots.push_back(i);
+                if (on_written && !on_written(c.len)) failed = true;
+            }
+        }
+    }
+
+    if (failed) return RingCopyResult::Failed;
+    return dst.seek(SeekableStream::OffsetType(dst_pos)) ? RingCopyResult::Done : RingCopyResult::Failed;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef URING_COPY_HPP_F04D6B2A_9E13_4C7A_8B5E_2D61A9C3E7F8
+#define URING_COPY_HPP_F04D6B2A_9E13_4C7A_8B5E_2D61A9C3E7F8
+
+#include "binary_file_stream.hpp"
+#include "copy_pipeline.hpp"
+
+enum class RingCopyResult {
+    Unavailable, // nothing was done, e.g. no io_uring support; copy some other way
+    Failed,
+    Done
+};
+
+// Copy `extents` to the current position of `dst` through a Linux io_uring.
+// Up to `queue_depth` chunks of `bufsize` bytes are in flight at once, read into and written from registered buffers,
+// with submissions and completions handled in batches.
+// Requires file-backed extents (BinaryFileStream) and a seekable `dst`, since chunks may complete out of order.
+// `dst` is positioned after the copied data on success. `on_written` works as for pipelined_copy().
+RingCopyResult uring_copy(BinaryFileStream& dst, const std::vector<CopyExtent>& extents,
+                          std::size_t bufsize, unsigned queue_depth,
+                          const std::function<bool(std::size_t)>& on_written = {}) noexcept;
+
+#endif /* URING_COPY_HPP_F04D6B2A_9E13_4C7A_8B5E_2D61A9C3E7F8 */
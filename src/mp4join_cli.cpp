@@ -1,16 +1,264 @@
 #include <mp4join/mp4join.hpp>
 #include <mp4join/version.hpp>
+#include <algorithm>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <vector>
 #include <thread>
 #include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+
+namespace {
+
+using namespace mp4join;
+
+// Set by Ctrl-C, to cancel the join or append under way (see JoinOptions::cancel).
+std::atomic<bool> interrupted = false;
+
+void
+on_interrupt(int)
+{
+    interrupted.store(true);
+}
+
+const char*
+phase_name(JoinProgress::Phase phase)
+{
+    switch (phase) {
+    case JoinProgress::Phase::Scan: return "scanning";
+    case JoinProgress::Phase::Moov: return "writing moov";
+    case JoinProgress::Phase::Mdat: return "copying";
+    case JoinProgress::Phase::Done: break;
+    }
+    return "done";
+}
+
+// Run `fn` (a join or append) with `options`, printing its progress as it goes. Ctrl-C cancels it.
+template <typename Fn>
+JoinResult
+run_with_progress(JoinOptions options, Fn fn, FILE* msg_out)
+{
+    constexpr double MiB = 1024 * 1024;
+    int width = 0; // of the progress line printed last
+
+    options.cancel = &interrupted;
+    options.progress = [&](const JoinProgress& p) {
+        char line_buf[128];
+        int n = std::snprintf(line_buf, sizeof line_buf, "\rProgress: %d%% %s", p.percent, phase_name(p.phase));
+        if (p.bytes_total) {
+            n += std::snprintf(line_buf + n, sizeof line_buf - n, " (%.1f of %.1f MiB, %.1f MiB/s)",
+                               p.bytes_done / MiB, p.bytes_total / MiB, p.bytes_per_second / MiB);
+        }
+        // print the whole string at once to avoid cursor flickering observed on MinGW,
+        // padded to cover what is left of the previous one
+        std::fprintf(msg_out, "%s%*s", line_buf, std::max(width - n, 0), "");
+        std::fflush(msg_out);
+        width = std::max(width, n);
+    };
+
+    const auto ret = fn(options);
+    std::fprintf(msg_out, "\r%*s\r", width, "");
+    return ret;
+}
+
+void
+print_error(JoinResult ret, FILE* msg_out)
+{
+    switch (ret) {
+    case(JoinResult::Success):
+        break;
+    case(JoinResult::InvalidInput):
+        std::fputs("MP4 join error: Invalid input file.\n", msg_out);
+        break;
+    case(JoinResult::IoError):
+        std::fputs("MP4 join error: Could not open file.\n", msg_out);
+        break;
+    case(JoinResult::InternalError):
+        std::fputs("MP4 join error: Internal error.\n", msg_out);
+        break;
+    case(JoinResult::Cancelled):
+        std::fputs("MP4 join cancelled.\n", msg_out);
+        break;
+    }
+}
+
+// --stats: one line per phase, then the latency histogram of the I/O calls of each phase that made any.
+void
+print_stats(const JoinStats& stats, FILE* msg_out)
+{
+    const std::pair<const char*, const JoinStats::PhaseStats*> phases[] = {
+        {"validate", &stats.validate}, {"merge", &stats.merge}, {"moov", &stats.moov}, {"mdat", &stats.mdat}
+    };
+    constexpr double MiB = 1024 * 1024;
+
+    std::fputs("Phase       Wall(s)    CPU(s)   Read(MiB)  Written(MiB)     Reads    Writes    Copies     Seeks\n", msg_out);
+    for (const auto& [name, p] : phases) {
+        std::fprintf(msg_out, "%-8s %10.3f %9.3f %11.1f %13.1f %9llu %9llu %9llu %9llu\n", name, p->wall_seconds, p->cpu_seconds,
+                     p->bytes_read / MiB, p->bytes_written / MiB, (unsigned long long)p->reads, (unsigned long long)p->writes,
+                     (unsigned long long)p->copies, (unsigned long long)p->seeks);
+    }
+    std::fprintf(msg_out, "Peak sample tables: %.1f MiB\n", stats.peak_table_bytes / MiB);
+
+    std::fputs("I/O latency in microseconds (calls):\n", msg_out);
+    for (const auto& [name, p] : phases) {
+        if (p->reads + p->writes + p->copies == 0) continue;
+        std::fprintf(msg_out, "%-8s", name);
+        const auto last = p->latency.size() - 1;
+        for (std::size_t i = 0; i <= last; ++i) {
+            const auto n = (unsigned long long)p->latency[i];
+            if (!n) continue;
+            if (i == 0) std::fprintf(msg_out, " <1:%llu", n);
+            else if (i == last) std::fprintf(msg_out, " >=%llu:%llu", 1ull << (i - 1), n);
+            else std::fprintf(msg_out, " %llu-%llu:%llu", 1ull << (i - 1), 1ull << i, n);
+        }
+        std::fputc('\n', msg_out);
+    }
+    std::fflush(msg_out);
+}
+
+// Watch mode: keep appending the chapters that show up in `dir` to `output`, in name order,
+// starting after `last`. A chapter is taken once its size has stayed the same for a whole poll interval.
+// Only returns if an append fails or is cancelled, or once Ctrl-C stops the watch in between appends.
+JoinResult
+watch(const char* dir, const char* last, const char* output, const JoinOptions& options, FILE* msg_out)
+{
+    namespace fs = std::filesystem;
+    const auto ext = fs::path(last).extension();
+    auto last_name = fs::path(last).filename();
+    std::optional<fs::path> pending; // next chapter, as seen by the previous poll
+    std::uintmax_t pending_size = 0;
+
+    std::fprintf(msg_out, "Watching %s for new chapters, press Ctrl-C to stop.\n", dir);
+    std::fflush(msg_out);
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+        if (interrupted.load()) {
+            std::fputs("Stopped watching.\n", msg_out);
+            return JoinResult::Success;
+        }
+
+        std::error_code ec;
+        std::optional<fs::path> next;
+        for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+            const auto& p = it->path();
+            if (!it->is_regular_file(ec) || p.extension() != ext || p.filename() <= last_name || fs::equivalent(p, output, ec)) continue;
+            if (!next || p.filename() < next->filename()) next = p;
+        }
+        if (!next) continue;
+
+        const auto size = fs::file_size(*next, ec);
+        if (ec) continue;
+        if (next != pending || size != pending_size) { // new, or still being written
+            pending = next;
+            pending_size = size;
+            continue;
+        }
+
+        const auto chapter = next->string();
+        const auto ret = run_with_progress(options, [&](const JoinOptions& o) {
+            return mp4_append(output, chapter.c_str(), o);
+        }, msg_out);
+        if (ret == JoinResult::InvalidInput) {
+            // Most likely the chapter isn't finished after all. The output is left as it was, so try again later.
+            std::fprintf(msg_out, "Chapter not ready yet: %s\n", chapter.c_str());
+            std::fflush(msg_out);
+            pending.reset();
+            continue;
+        }
+        if (ret != JoinResult::Success) {
+            print_error(ret, msg_out);
+            return ret;
+        }
+        std::fprintf(msg_out, "Appended: %s\n", chapter.c_str());
+        std::fflush(msg_out);
+        if (options.stats) print_stats(*options.stats, msg_out);
+        last_name = next->filename();
+        pending.reset();
+    }
+}
+
+// Manifest mode: run every join listed in `manifest` through one JoinSession.
+// One job per line: the output file, then the input files, separated by tabs. Empty lines and lines starting with '#' are skipped.
+// With `stats`, each job's JoinStats are printed once it's done, and with `crc`, the CRC-32C of its output.
+JoinResult
+run_manifest(const char* manifest, const JoinOptions& options, const SessionOptions& session_options, bool stats, bool crc, FILE* msg_out)
+{
+    std::ifstream in(manifest);
+    if (!in) {
+        std::fprintf(msg_out, "Could not read manifest: %s\n", manifest);
+        return JoinResult::IoError;
+    }
+
+    std::vector<JoinJob> jobs;
+    for (std::string line; std::getline(in, line);) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line.front() == '#') continue;
+        JoinJob job;
+        job.options = options;
+        for (std::size_t pos = 0;;) {
+            const auto tab = line.find('\t', pos);
+            auto& field = job.output_file.empty() ? job.output_file : job.input_files.emplace_back();
+            field = line.substr(pos, tab - pos);
+            if (tab == std::string::npos) break;
+            pos = tab + 1;
+        }
+        if (job.input_files.size() < 2) {
+            std::fprintf(msg_out, "Bad manifest line: %s\n", line.c_str());
+            return JoinResult::InvalidInput;
+        }
+        jobs.push_back(std::move(job));
+    }
+
+    std::mutex msg_mutex;
+    JoinResult ret = JoinResult::Success;
+    std::vector<JoinStats> job_stats(stats ? jobs.size() : 0); // one per job, as they run concurrently
+    std::vector<std::uint32_t> job_crcs(crc ? jobs.size() : 0);
+    JoinSession session(session_options);
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        if (stats) jobs[i].options.stats = &job_stats[i];
+        if (crc) jobs[i].options.crc32c = &job_crcs[i];
+        const bool queued = session.submit(std::move(jobs[i]), [&](const JoinJob& job, JoinResult r) {
+            std::lock_guard lock(msg_mutex);
+            if (r == JoinResult::Success && job.options.crc32c) {
+                std::fprintf(msg_out, "MP4 join done: %s (CRC-32C %08x)\n", job.output_file.c_str(), unsigned(*job.options.crc32c));
+            }
+            else if (r == JoinResult::Success) std::fprintf(msg_out, "MP4 join done: %s\n", job.output_file.c_str());
+            else {
+                std::fprintf(msg_out, "%s: ", job.output_file.c_str());
+                print_error(r, msg_out);
+                ret = r;
+            }
+            std::fflush(msg_out);
+            if (job.options.stats) print_stats(*job.options.stats, msg_out);
+        });
+        if (!queued) return JoinResult::InternalError; // the session still finishes what it has
+    }
+    session.wait();
+    return ret;
+}
+
+}
 
 
 int main(int argc, char** argv)
 {
     std::vector<const char*> inputs;
     const char* output = nullptr;
+    const char* watch_dir = nullptr;
+    const char* manifest = nullptr;
+    mp4join::JoinOptions options;
+    mp4join::SessionOptions session_options;
+    mp4join::JoinStats stats;
+    bool print_stats_flag = false;
+    std::uint32_t crc = 0;
+    bool print_crc_flag = false;
 
     {
         bool print_version = false;
@@ -20,6 +268,48 @@ int main(int argc, char** argv)
                 if (++i < argc) output = argv[i];
                 else err_flag = 1;
             }
+            else if (!std::strcmp(argv[i], "-w")) {
+                if (++i < argc) watch_dir = argv[i];
+                else err_flag = 1;
+            }
+            else if (!std::strcmp(argv[i], "-b")) {
+                if (++i < argc) manifest = argv[i];
+                else err_flag = 1;
+            }
+            else if (!std::strcmp(argv[i], "-j")) {
+                char* end = nullptr;
+                if (++i < argc) session_options.max_jobs_per_device = unsigned(std::strtoul(argv[i], &end, 10));
+                err_flag = !end || *end || session_options.max_jobs_per_device == 0;
+            }
+            else if (!std::strcmp(argv[i], "-l")) {
+                char* end = nullptr;
+                if (++i < argc) options.table_memory_limit = std::size_t(std::strtoull(argv[i], &end, 10)) << 20; // MiB
+                err_flag = !end || *end || options.table_memory_limit == 0;
+            }
+            else if (!std::strcmp(argv[i], "-f")) {
+                options.faststart = true;
+            }
+            else if (!std::strcmp(argv[i], "-c")) {
+                options.bypass_page_cache = true;
+            }
+            else if (!std::strcmp(argv[i], "-p")) {
+                options.huge_pages = true;
+            }
+            else if (!std::strcmp(argv[i], "-u")) {
+                options.io_uring = true;
+            }
+            else if (!std::strcmp(argv[i], "-r")) {
+                options.reference = true;
+            }
+            else if (!std::strcmp(argv[i], "-m")) {
+                options.fragmented = true;
+            }
+            else if (!std::strcmp(argv[i], "--stats")) {
+                print_stats_flag = true;
+            }
+            else if (!std::strcmp(argv[i], "--crc32c")) {
+                print_crc_flag = true;
+            }
             else if (!std::strcmp(argv[i], "-v")) {
                 print_version = true;
                 break;
@@ -35,56 +325,51 @@ int main(int argc, char** argv)
             std::printf("Version %s, %s\n", COMMIT_HASH, COMMIT_DATE);
             return 0;
         }
-        if (err_flag || !output || inputs.size() < 2) {
-            std::puts("Usage: mp4join <file_1> <file_2> [...] <-o output_file> [-v]");
+        // Watch mode appends in place, which only works for the plain layout.
+        const bool bad_watch = watch_dir && (!output || !std::strcmp(output, "-") || options.faststart || options.reference || options.fragmented);
+        // Manifest mode takes its inputs and outputs from the manifest.
+        const bool bad_files = manifest ? output || !inputs.empty() || watch_dir : !output || inputs.size() < 2;
+        if (err_flag || bad_files || (options.reference && options.fragmented) || bad_watch) {
+            std::puts("Usage: mp4join <file_1> <file_2> [...] <-o output_file|-> [-f] [-u] [-c] [-p] [-r] [-m] [-l MiB] [-w dir] [--stats] [--crc32c] [-v]\n"
+                      "       mp4join -b manifest [-j jobs_per_device] [-f] [-u] [-c] [-p] [-r] [-m] [-l MiB] [--stats] [--crc32c]");
             return 1;
         }
     }
 
-    using namespace mp4join;
-    JoinResult ret;
-    std::atomic<bool> done = false;
-    std::atomic<int> prog = -1;
-    int prog_prev = -1;
-    
-    const auto prog_cb = [&] (int prog_) {
-        prog.store(prog_);
-    };
-    std::thread worker {
-        [&] {
-            ret = mp4_join((int)inputs.size(), inputs.data(), output, prog_cb);
-            done.store(true);
-        }
-    };
+    // Ctrl-C cancels whatever is running, and the partial output goes with it.
+    std::signal(SIGINT, on_interrupt);
+    if (manifest) {
+        options.cancel = &interrupted;
+        return static_cast<int>(run_manifest(manifest, options, session_options, print_stats_flag, print_crc_flag, stdout));
+    }
+    if (print_stats_flag) options.stats = &stats;
+    if (print_crc_flag) options.crc32c = &crc;
 
-    for (int cnt = 0; !done.load(); cnt += (cnt < 10), std::this_thread::sleep_for(std::chrono::milliseconds(cnt <= 3 ? 1 : 100))) {
-        const auto prog_new = prog.load();
-        if (prog_new > prog_prev) {
-            prog_prev = prog_new;
-            static char line_buf[32];
-            // print the whole string at once to avoid cursor flickering observed on MinGW
-            std::snprintf(line_buf, 32, "\rProgress: %d%%", prog_prev);
-            std::fputs(line_buf, stdout);
-            std::fflush(stdout);
-        }
+    // "-o -" streams the joined file to stdout, messages go to stderr then.
+    const bool to_stdout = !std::strcmp(output, "-");
+    FILE* const msg_out = to_stdout ? stderr : stdout;
+    if (to_stdout) {
+#ifdef _WIN32
+        std::fputs("Writing to stdout is not supported on this platform.\n", stderr);
+        return 1;
+#else
+        output = "/dev/stdout";
+#endif
     }
 
-    worker.join();
+    auto ret = run_with_progress(options, [&](const JoinOptions& o) {
+        return mp4_join((int)inputs.size(), inputs.data(), output, o);
+    }, msg_out);
 
-    std::putchar('\r');
-    switch (ret) {
-    case(JoinResult::Success):
-        std::printf("MP4 join done: %s\n", output);
-        break;
-    case(JoinResult::InvalidInput):
-        std::puts("MP4 join error: Invalid input file.");
-        break;
-    case(JoinResult::IoError):
-        std::puts("MP4 join error: Could not open file.");
-        break;
-    case(JoinResult::InternalError):
-        std::puts("MP4 join error: Internal error.");
-        break;
+    if (ret == JoinResult::Success) {
+        std::fprintf(msg_out, "MP4 join done: %s\n", to_stdout ? "-" : output);
+        if (options.crc32c) std::fprintf(msg_out, "CRC-32C: %08x\n", unsigned(crc));
+        if (options.stats) print_stats(*options.stats, msg_out);
+        if (watch_dir) ret = watch(watch_dir, inputs.back(), output, options, msg_out);
+    }
+    else {
+        print_error(ret, msg_out);
+        if (options.stats) print_stats(*options.stats, msg_out);
     }
 
     return static_cast<int>(ret);
@@ -0,0 +1,116 @@
+// Cancels io_uring copies midway, puts back what they overwrote the way mp4_append() does, and checks that no
+// request still in flight lands afterwards. Exits with 77 (skipped) where io_uring is unavailable.
+#include "uring_copy.hpp"
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+namespace fs = std::filesystem;
+
+constexpr std::size_t bufsize = 256 * 1024;
+constexpr unsigned queue_depth = 32;
+constexpr std::size_t head_size = 1 << 20;   // left alone by the copy
+constexpr std::size_t tail_size = 4 << 20;   // the old moov, overwritten by the copy and then put back
+constexpr std::size_t source_size = 16 << 20;
+
+std::vector<unsigned char>
+random_bytes(std::size_t n, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<unsigned char> v(n);
+    for (std::size_t i = 0; i < n; i += 4) {
+        const auto r = rng();
+        for (std::size_t k = 0; k < 4 && i + k < n; ++k) v[i + k] = static_cast<unsigned char>(r >> (8 * k));
+    }
+    return v;
+}
+
+bool
+write_file(const fs::path& path, const std::vector<unsigned char>& data)
+{
+    std::ofstream f(path, std::ios::binary);
+    return f.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size())) && f.flush();
+}
+
+std::vector<unsigned char>
+read_file(const fs::path& path)
+{
+    std::error_code ec;
+    std::vector<unsigned char> v(std::size_t(fs::file_size(path, ec)));
+    std::ifstream f(path, std::ios::binary);
+    if (ec || !f.read(reinterpret_cast<char*>(v.data()), std::streamsize(v.size()))) v.clear();
+    return v;
+}
+
+int
+fail(const char* what)
+{
+    std::fprintf(stderr, "FAILED: %s\n", what);
+    return 1;
+}
+
+}
+
+int main()
+{
+    const auto dir = fs::temp_directory_path() / ("mp4join_uring_copy_test_" + std::to_string(std::random_device{}()));
+    fs::create_directories(dir);
+    struct Cleanup { fs::path p; ~Cleanup() { std::error_code ec; fs::remove_all(p, ec); } } cleanup{dir};
+
+    const auto src_path = dir / "source", out_path = dir / "output";
+    const auto source = random_bytes(source_size, 1);
+    auto original = random_bytes(head_size, 2);
+    const auto tail = random_bytes(tail_size, 3);
+    original.insert(original.end(), tail.begin(), tail.end());
+    if (!write_file(src_path, source)) return fail("writing the source");
+
+    BinaryFileStream src;
+    if (!src.open(src_path.string())) return fail("opening the source");
+    const std::vector<CopyExtent> extents{{&src, 0, source_size}};
+
+    // A copy that runs to the end.
+    {
+        if (!write_file(out_path, original)) return fail("writing the output");
+        BinaryFileStream out;
+        if (!out.open(out_path.string(), BinaryFileStream::OpenMode::UPDATE) || !out.seek(head_size)) return fail("opening the output");
+        const auto ret = uring_copy(out, extents, bufsize, queue_depth);
+        if (ret == RingCopyResult::Unavailable) {
+            std::puts("io_uring unavailable, skipped");
+            return 77;
+        }
+        if (ret != RingCopyResult::Done || !out.close()) return fail("full copy");
+        auto expected = original;
+        expected.resize(head_size);
+        expected.insert(expected.end(), source.begin(), source.end());
+        if (read_file(out_path) != expected) return fail("full copy output");
+    }
+
+    // Copies cancelled after a few buffers, with many more still in flight.
+    for (unsigned run = 0; run < 20; ++run) {
+        if (!write_file(out_path, original)) return fail("writing the output");
+        BinaryFileStream out;
+        if (!out.open(out_path.string(), BinaryFileStream::OpenMode::UPDATE) || !out.seek(head_size)) return fail("opening the output");
+        unsigned written = 0;
+        const auto ret = uring_copy(out, extents, bufsize, queue_depth, [&](std::size_t) { return ++written <= run % 4; });
+        if (ret != RingCopyResult::Failed) return fail("cancelled copy result");
+
+        // Put the old tail back and cut off the rest, as append_in_place() does.
+        if (!out.seek(head_size) || !out.write(tail.data(), tail.size()) || !out.close()) return fail("restoring the output");
+        std::error_code ec;
+        fs::resize_file(out_path, original.size(), ec);
+        if (ec) return fail("truncating the output");
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(20)); // time for stray writes to land
+        if (read_file(out_path) != original) return fail("restored output differs from the original");
+    }
+
+    std::puts("OK");
+    return 0;
+}